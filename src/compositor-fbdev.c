@@ -522,7 +522,8 @@ fbdev_output_create(struct fbdev_backend *backend,
 			   1);
 
 	if (backend->use_pixman) {
-		if (pixman_renderer_output_create(&output->base) < 0)
+		if (pixman_renderer_output_create(&output->base,
+					PIXMAN_RENDERER_OUTPUT_USE_SHADOW) < 0)
 			goto out_hw_surface;
 	} else {
 		setenv("HYBRIS_EGLPLATFORM", "wayland", 1);
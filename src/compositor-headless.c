@@ -168,7 +168,7 @@ headless_backend_create_output(struct headless_backend *b,
 							 output->image_buf,
 							 param->width * 4);
 
-		if (pixman_renderer_output_create(&output->base) < 0)
+		if (pixman_renderer_output_create(&output->base, 0) < 0)
 			return -1;
 
 		pixman_renderer_output_set_buffer(&output->base,
@@ -71,6 +71,12 @@ weston_output_transform_scale_init(struct weston_output *output,
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor);
 
+static void
+weston_compositor_pick_changed(struct weston_compositor *compositor);
+
+static void
+weston_view_update_pick(struct weston_view *view);
+
 static void weston_mode_switch_finish(struct weston_output *output,
 				      int mode_changed,
 				      int scale_changed)
@@ -1126,6 +1132,10 @@ weston_surface_assign_output(struct weston_surface *es)
 	}
 	pixman_region32_fini(&region);
 
+	/* Sub-surface views are only listed for mapped surfaces */
+	if ((es->output == NULL) != (new_output == NULL))
+		es->compositor->view_list_dirty = 1;
+
 	es->output = new_output;
 	weston_surface_update_output_mask(es, mask);
 }
@@ -1342,12 +1352,31 @@ get_view_layer(struct weston_view *view)
 	return view->layer_link.layer;
 }
 
+static void
+weston_view_update_motion(struct weston_view *view,
+			  const pixman_box32_t *old, int was_enabled)
+{
+	pixman_box32_t *box = pixman_region32_extents(&view->transform.boundingbox);
+
+	if (was_enabled || view->transform.enabled ||
+	    box->x2 - box->x1 != old->x2 - old->x1 ||
+	    box->y2 - box->y1 != old->y2 - old->y1) {
+		view->transform.motion.valid = false;
+		return;
+	}
+
+	view->transform.motion.dx += box->x1 - old->x1;
+	view->transform.motion.dy += box->y1 - old->y1;
+}
+
 WL_EXPORT void
 weston_view_update_transform(struct weston_view *view)
 {
 	struct weston_view *parent = view->geometry.parent;
 	struct weston_layer *layer;
 	pixman_region32_t mask;
+	pixman_box32_t old_box;
+	int was_enabled;
 
 	if (!view->transform.dirty)
 		return;
@@ -1359,6 +1388,9 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_damage_below(view);
 
+	old_box = *pixman_region32_extents(&view->transform.boundingbox);
+	was_enabled = view->transform.enabled;
+
 	pixman_region32_fini(&view->transform.boundingbox);
 	pixman_region32_fini(&view->transform.opaque);
 	pixman_region32_init(&view->transform.opaque);
@@ -1396,6 +1428,9 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_damage_below(view);
 
+	weston_view_update_motion(view, &old_box, was_enabled);
+	weston_view_update_pick(view);
+
 	weston_view_assign_output(view);
 
 	wl_signal_emit(&view->surface->compositor->transform_signal,
@@ -1790,38 +1825,284 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
-WL_EXPORT struct weston_view *
-weston_compositor_pick_view(struct weston_compositor *compositor,
-			    wl_fixed_t x, wl_fixed_t y,
-			    wl_fixed_t *vx, wl_fixed_t *vy)
+static void
+weston_compositor_pick_changed(struct weston_compositor *compositor)
 {
-	struct weston_view *view;
-	wl_fixed_t view_x, view_y;
-	int view_ix, view_iy;
-	int ix = wl_fixed_to_int(x);
-	int iy = wl_fixed_to_int(y);
+	compositor->pick_grid.dirty = 1;
+	compositor->pick_generation++;
+}
+
+static void
+weston_pick_grid_release(struct weston_pick_grid *grid)
+{
+	int i;
+
+	for (i = 0; i < grid->cols * grid->rows; i++)
+		wl_array_release(&grid->cells[i]);
+	free(grid->cells);
+	grid->cells = NULL;
+	grid->cols = grid->rows = 0;
+}
+
+#define PICK_GRID_CELL_SIZE 128
+
+/* Cells the view's bounding box touches, x2 and y2 exclusive */
+static void
+weston_pick_grid_cells(const struct weston_pick_grid *grid,
+		       struct weston_view *view,
+		       int *cx1, int *cy1, int *cx2, int *cy2)
+{
+	const pixman_box32_t *extents = &grid->extents;
+	pixman_box32_t *box;
+	int x1, y1, x2, y2;
+
+	box = pixman_region32_extents(&view->transform.boundingbox);
+	x1 = MAX(box->x1, extents->x1) - extents->x1;
+	y1 = MAX(box->y1, extents->y1) - extents->y1;
+	x2 = MIN(box->x2, extents->x2) - extents->x1;
+	y2 = MIN(box->y2, extents->y2) - extents->y1;
+	if (x1 >= x2 || y1 >= y2) {
+		*cx1 = *cy1 = *cx2 = *cy2 = 0;
+		return;
+	}
+
+	*cx1 = x1 / PICK_GRID_CELL_SIZE;
+	*cy1 = y1 / PICK_GRID_CELL_SIZE;
+	*cx2 = (x2 - 1) / PICK_GRID_CELL_SIZE + 1;
+	*cy2 = (y2 - 1) / PICK_GRID_CELL_SIZE + 1;
+}
+
+static int
+weston_pick_grid_build(struct weston_pick_grid *grid,
+		       struct weston_compositor *compositor,
+		       const pixman_box32_t *extents)
+{
+	struct weston_view *view, **v;
+	int cols, rows, i, x, y;
+	int order = 0;
+
+	cols = (extents->x2 - extents->x1 + PICK_GRID_CELL_SIZE - 1) /
+		PICK_GRID_CELL_SIZE;
+	rows = (extents->y2 - extents->y1 + PICK_GRID_CELL_SIZE - 1) /
+		PICK_GRID_CELL_SIZE;
+
+	if (cols * rows != grid->cols * grid->rows || !grid->cells) {
+		weston_pick_grid_release(grid);
+		if (cols * rows == 0)
+			return -1;
+		grid->cells = calloc(cols * rows, sizeof *grid->cells);
+		if (!grid->cells)
+			return -1;
+	} else {
+		for (i = 0; i < cols * rows; i++)
+			grid->cells[i].size = 0;
+	}
+	grid->cols = cols;
+	grid->rows = rows;
+	grid->extents = *extents;
+	grid->serial++;
 
 	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
+		view->pick.serial = grid->serial;
+		view->pick.order = order++;
+		weston_pick_grid_cells(grid, view,
+				       &view->pick.x1, &view->pick.y1,
+				       &view->pick.x2, &view->pick.y2);
+
+		for (y = view->pick.y1; y < view->pick.y2; y++) {
+			for (x = view->pick.x1; x < view->pick.x2; x++) {
+				v = wl_array_add(&grid->cells[y * cols + x],
+						 sizeof *v);
+				if (!v)
+					return -1;
+				*v = view;
+			}
+		}
+	}
+
+	grid->dirty = 0;
+	return 0;
+}
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
+/* Inserts the view into a cell in view list order */
+static int
+weston_pick_grid_insert(struct weston_pick_grid *grid,
+			struct weston_view *view, int x, int y)
+{
+	struct wl_array *cell = &grid->cells[y * grid->cols + x];
+	struct weston_view **v, **last;
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (!wl_array_add(cell, sizeof *v))
+		return -1;
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
+	last = (struct weston_view **) ((char *) cell->data + cell->size) - 1;
+	for (v = cell->data; v < last; v++)
+		if ((*v)->pick.order > view->pick.order)
+			break;
+	memmove(v + 1, v, (char *) last - (char *) v);
+	*v = view;
+	return 0;
+}
+
+static void
+weston_pick_grid_remove(struct weston_pick_grid *grid,
+			struct weston_view *view, int x, int y)
+{
+	struct wl_array *cell = &grid->cells[y * grid->cols + x];
+	struct weston_view **v, **end;
+
+	end = (struct weston_view **) ((char *) cell->data + cell->size);
+	for (v = cell->data; v < end; v++) {
+		if (*v == view) {
+			memmove(v, v + 1, (char *) end - (char *) (v + 1));
+			cell->size -= sizeof *v;
+			return;
+		}
+	}
+}
+
+static bool
+cell_in(int x, int y, int x1, int y1, int x2, int y2)
+{
+	return x >= x1 && x < x2 && y >= y1 && y < y2;
+}
+
+/* Moves a transformed view from the cells of its old bounding box to
+ * the ones of the new, cells covered by both are left alone. Restacks
+ * and output changes rebuild the whole grid instead.
+ */
+static void
+weston_view_update_pick(struct weston_view *view)
+{
+	struct weston_compositor *compositor = view->surface->compositor;
+	struct weston_pick_grid *grid = &compositor->pick_grid;
+	int x1, y1, x2, y2, x, y;
+
+	compositor->pick_generation++;
+	if (grid->dirty || view->pick.serial != grid->serial)
+		return;
+
+	weston_pick_grid_cells(grid, view, &x1, &y1, &x2, &y2);
+	if (x1 == view->pick.x1 && y1 == view->pick.y1 &&
+	    x2 == view->pick.x2 && y2 == view->pick.y2)
+		return;
+
+	for (y = view->pick.y1; y < view->pick.y2; y++)
+		for (x = view->pick.x1; x < view->pick.x2; x++)
+			if (!cell_in(x, y, x1, y1, x2, y2))
+				weston_pick_grid_remove(grid, view, x, y);
+
+	for (y = y1; y < y2; y++) {
+		for (x = x1; x < x2; x++) {
+			if (cell_in(x, y, view->pick.x1, view->pick.y1,
+				    view->pick.x2, view->pick.y2))
+				continue;
+			if (weston_pick_grid_insert(grid, view, x, y) < 0) {
+				grid->dirty = 1;
+				return;
+			}
+		}
+	}
+
+	view->pick.x1 = x1;
+	view->pick.y1 = y1;
+	view->pick.x2 = x2;
+	view->pick.y2 = y2;
+}
+
+static void
+weston_compositor_output_extents(struct weston_compositor *compositor,
+				 pixman_box32_t *extents)
+{
+	struct weston_output *output;
+	pixman_box32_t *box;
+
+	*extents = (pixman_box32_t) { 0, 0, 0, 0 };
+	wl_list_for_each(output, &compositor->output_list, link) {
+		box = pixman_region32_extents(&output->region);
+		if (extents->x1 == extents->x2) {
+			*extents = *box;
 			continue;
+		}
+		extents->x1 = MIN(extents->x1, box->x1);
+		extents->y1 = MIN(extents->y1, box->y1);
+		extents->x2 = MAX(extents->x2, box->x2);
+		extents->y2 = MAX(extents->y2, box->y2);
+	}
+}
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+static bool
+weston_view_accepts_point(struct weston_view *view,
+			  wl_fixed_t x, wl_fixed_t y,
+			  wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	wl_fixed_t view_x, view_y;
+	int view_ix, view_iy;
+
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    wl_fixed_to_int(x),
+					    wl_fixed_to_int(y), NULL))
+		return false;
+
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
+
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
+/** Find the topmost view accepting input at a global position
+ *
+ * Only the views of the grid cell under the position are tested. The
+ * grid is rebuilt lazily after view list or output changes, views are
+ * moved in it as their transforms are updated.
+ * Positions outside all outputs fall back to walking the view list.
+ */
+WL_EXPORT struct weston_view *
+weston_compositor_pick_view(struct weston_compositor *compositor,
+			    wl_fixed_t x, wl_fixed_t y,
+			    wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_pick_grid *grid = &compositor->pick_grid;
+	struct weston_view *view, **v;
+	struct wl_array *cell;
+	pixman_box32_t extents;
+	int ix = wl_fixed_to_int(x);
+	int iy = wl_fixed_to_int(y);
+
+	weston_compositor_output_extents(compositor, &extents);
+	if (grid->dirty ||
+	    memcmp(&extents, &grid->extents, sizeof extents) != 0) {
+		if (weston_pick_grid_build(grid, compositor, &extents) < 0)
+			grid->dirty = 1;
+	}
+
+	if (!grid->dirty &&
+	    ix >= extents.x1 && ix < extents.x2 &&
+	    iy >= extents.y1 && iy < extents.y2) {
+		cell = &grid->cells[(iy - extents.y1) / PICK_GRID_CELL_SIZE *
+				    grid->cols +
+				    (ix - extents.x1) / PICK_GRID_CELL_SIZE];
+		wl_array_for_each(v, cell) {
+			if (weston_view_accepts_point(*v, x, y, vx, vy))
+				return *v;
+		}
+	} else {
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (weston_view_accepts_point(view, x, y, vx, vy))
+				return view;
+		}
 	}
 
 	*vx = wl_fixed_from_int(-1000000);
@@ -1833,12 +2114,33 @@ static void
 weston_compositor_repick(struct weston_compositor *compositor)
 {
 	struct weston_seat *seat;
+	struct weston_pointer *pointer;
 
 	if (!compositor->session_active)
 		return;
 
-	wl_list_for_each(seat, &compositor->seat_list, link)
+	wl_list_for_each(seat, &compositor->seat_list, link) {
+		pointer = weston_seat_get_pointer(seat);
+		if (!pointer)
+			continue;
+
+		/* Neither the pointer nor anything pickable has changed
+		 * since the last repick, it would find the same view. */
+		if (pointer->repick_generation == compositor->pick_generation &&
+		    pointer->repick_focus == pointer->focus &&
+		    pointer->repick_grab == pointer->grab &&
+		    pointer->repick_x == pointer->x &&
+		    pointer->repick_y == pointer->y)
+			continue;
+
 		weston_seat_repick(seat);
+
+		pointer->repick_generation = compositor->pick_generation;
+		pointer->repick_focus = pointer->focus;
+		pointer->repick_grab = pointer->grab;
+		pointer->repick_x = pointer->x;
+		pointer->repick_y = pointer->y;
+	}
 }
 
 WL_EXPORT void
@@ -1855,6 +2157,8 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	view->surface->compositor->view_list_dirty = 1;
+	weston_compositor_pick_changed(view->surface->compositor);
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -1884,6 +2188,7 @@ weston_surface_unmap(struct weston_surface *surface)
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
 	surface->output = NULL;
+	surface->compositor->view_list_dirty = 1;
 }
 
 static void
@@ -1910,6 +2215,7 @@ weston_view_destroy(struct weston_view *view)
 
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
+	weston_compositor_pick_changed(view->surface->compositor);
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -2097,58 +2403,95 @@ surface_flush_damage(struct weston_surface *surface)
 }
 
 static void
-view_accumulate_damage(struct weston_view *view,
-		       pixman_region32_t *opaque)
+view_global_damage(struct weston_view *view, pixman_region32_t *damage)
 {
-	pixman_region32_t damage;
-
-	pixman_region32_init(&damage);
 	if (view->transform.enabled) {
 		pixman_box32_t *extents;
 
 		extents = pixman_region32_extents(&view->surface->damage);
-		view_compute_bbox(view, extents, &damage);
+		view_compute_bbox(view, extents, damage);
 	} else {
-		pixman_region32_copy(&damage, &view->surface->damage);
-		pixman_region32_translate(&damage,
+		pixman_region32_copy(damage, &view->surface->damage);
+		pixman_region32_translate(damage,
 					  view->geometry.x, view->geometry.y);
 	}
 
-	pixman_region32_intersect(&damage, &damage,
+	pixman_region32_intersect(damage, damage,
 				  &view->transform.boundingbox);
-	pixman_region32_subtract(&damage, &damage, opaque);
-	pixman_region32_union(&view->plane->damage,
-			      &view->plane->damage, &damage);
-	pixman_region32_fini(&damage);
+}
+
+/* Primary plane damage goes to each output the view is on, clipped to
+ * it. Other planes belong to single outputs, they keep their own.
+ */
+static void
+view_add_damage(struct weston_view *view, pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = view->surface->compositor;
+	struct weston_output *output;
+	pixman_region32_t share;
+
+	if (view->plane != &ec->primary_plane) {
+		pixman_region32_union(&view->plane->damage,
+				      &view->plane->damage, damage);
+		return;
+	}
+
+	pixman_region32_init(&share);
+	wl_list_for_each(output, &ec->output_list, link) {
+		if (!(view->output_mask & (1u << output->id)))
+			continue;
+		pixman_region32_intersect(&share, damage, &output->region);
+		pixman_region32_union(&output->damage,
+				      &output->damage, &share);
+	}
+	pixman_region32_fini(&share);
+}
+
+static void
+view_accumulate_damage(struct weston_view *view,
+		       pixman_region32_t *opaque)
+{
+	pixman_region32_t damage;
+
+	if (pixman_region32_not_empty(&view->surface->damage)) {
+		pixman_region32_init(&damage);
+		view_global_damage(view, &damage);
+		pixman_region32_subtract(&damage, &damage, opaque);
+		view_add_damage(view, &damage);
+		pixman_region32_fini(&damage);
+	}
 	pixman_region32_copy(&view->clip, opaque);
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
 }
 
+/* Views are walked once, each plane collecting the opaque region of
+ * its views so far. Surface damage is flushed by the first repaint
+ * after it is committed, and shared out to outputs right then, culled
+ * by the opaque views above.
+ */
 static void
 compositor_accumulate_damage(struct weston_compositor *ec)
 {
 	struct weston_plane *plane;
 	struct weston_view *ev;
-	pixman_region32_t opaque, clip;
+	pixman_region32_t clip;
 
-	pixman_region32_init(&clip);
-
-	wl_list_for_each(plane, &ec->plane_list, link) {
-		pixman_region32_copy(&plane->clip, &clip);
-
-		pixman_region32_init(&opaque);
-
-		wl_list_for_each(ev, &ec->view_list, link) {
-			if (ev->plane != plane)
-				continue;
+	wl_list_for_each(plane, &ec->plane_list, link)
+		pixman_region32_clear(&plane->opaque);
 
-			view_accumulate_damage(ev, &opaque);
-		}
+	wl_list_for_each(ev, &ec->view_list, link) {
+		/* Views of planes not stacked are not shown */
+		if (!ev->plane || wl_list_empty(&ev->plane->link))
+			continue;
 
-		pixman_region32_union(&clip, &clip, &opaque);
-		pixman_region32_fini(&opaque);
+		view_accumulate_damage(ev, &ev->plane->opaque);
 	}
 
+	pixman_region32_init(&clip);
+	wl_list_for_each(plane, &ec->plane_list, link) {
+		pixman_region32_copy(&plane->clip, &clip);
+		pixman_region32_union(&clip, &clip, &plane->opaque);
+	}
 	pixman_region32_fini(&clip);
 
 	wl_list_for_each(ev, &ec->view_list, link)
@@ -2159,6 +2502,11 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 			continue;
 		ev->surface->touched = true;
 
+		if (!ev->surface->flush_pending &&
+		    !pixman_region32_not_empty(&ev->surface->damage))
+			continue;
+		ev->surface->flush_pending = false;
+
 		surface_flush_damage(ev->surface);
 
 		/* Both the renderer and the backend have seen the buffer
@@ -2282,6 +2630,10 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	struct weston_view *view;
 	struct weston_layer *layer;
 
+	/* Cleared first, transform updates below may set it again */
+	compositor->view_list_dirty = 0;
+	weston_compositor_pick_changed(compositor);
+
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_stash_subsurface_views(view->surface);
@@ -2298,6 +2650,65 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 			surface_free_unused_subsurface_views(view->surface);
 }
 
+/* Shells link and unlink whole layers themselves, so the layer list
+ * is compared with the one view_list was built from.
+ */
+static bool
+weston_compositor_layers_changed(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer, **layers, **l;
+	size_t count, i = 0;
+
+	layers = compositor->view_list_layers.data;
+	count = compositor->view_list_layers.size / sizeof *layers;
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		if (i == count || layers[i] != layer)
+			break;
+		i++;
+	}
+	if (i == count && &layer->link == &compositor->layer_list)
+		return false;
+
+	compositor->view_list_layers.size = 0;
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		l = wl_array_add(&compositor->view_list_layers, sizeof *l);
+		if (!l) {
+			/* Compared as changed again next time */
+			compositor->view_list_layers.size = 0;
+			break;
+		}
+		*l = layer;
+	}
+
+	return true;
+}
+
+/** Bring the view list up to date for a repaint
+ *
+ * The flattened view list is only rebuilt when layers, layer entries,
+ * sub-surface stacking or mapping have changed since it was built.
+ * Otherwise only the transforms of the listed views are updated.
+ */
+static void
+weston_compositor_update_view_list(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+
+	if (weston_compositor_layers_changed(compositor))
+		compositor->view_list_dirty = 1;
+
+	if (!compositor->view_list_dirty) {
+		wl_list_for_each(view, &compositor->view_list, link)
+			weston_view_update_transform(view);
+
+		/* A transform may have (un)mapped a sub-surface */
+		if (!compositor->view_list_dirty)
+			return;
+	}
+
+	weston_compositor_build_view_list(compositor);
+}
+
 static void
 weston_output_take_feedback_list(struct weston_output *output,
 				 struct weston_surface *surface)
@@ -2339,8 +2750,8 @@ weston_output_repaint(struct weston_output *output)
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
-	/* Rebuild the surface list and update surface transforms up front. */
-	weston_compositor_build_view_list(ec);
+	/* Update the surface list and surface transforms up front. */
+	weston_compositor_update_view_list(ec);
 
 	if (output->assign_planes && !output->disable_planes) {
 		output->assign_planes(output);
@@ -2367,6 +2778,11 @@ weston_output_repaint(struct weston_output *output)
 
 	compositor_accumulate_damage(ec);
 
+	/* What the backend leaves of it on the plane is repainted later */
+	pixman_region32_union(&ec->primary_plane.damage,
+			      &ec->primary_plane.damage, &output->damage);
+	pixman_region32_clear(&output->damage);
+
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
 				  &ec->primary_plane.damage, &output->region);
@@ -2380,6 +2796,14 @@ weston_output_repaint(struct weston_output *output)
 
 	pixman_region32_fini(&output_damage);
 
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!(ev->output_mask & (1u << output->id)))
+			continue;
+		ev->transform.motion.valid = true;
+		ev->transform.motion.dx = 0;
+		ev->transform.motion.dy = 0;
+	}
+
 	output->repaint_needed = 0;
 
 	weston_compositor_repick(ec);
@@ -2510,13 +2934,23 @@ WL_EXPORT void
 weston_layer_entry_insert(struct weston_layer_entry *list,
 			  struct weston_layer_entry *entry)
 {
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	view->surface->compositor->view_list_dirty = 1;
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
+	if (entry->layer)
+		view->surface->compositor->view_list_dirty = 1;
+
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2729,6 +3163,18 @@ static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
+	struct wl_list *current = surface->subsurface_list.next;
+
+	/* Most commits keep the order, view list stays valid then */
+	wl_list_for_each(sub, &surface->subsurface_list_pending,
+			 parent_link_pending) {
+		if (current != &sub->parent_link)
+			break;
+		current = current->next;
+	}
+	if (&sub->parent_link_pending != &surface->subsurface_list_pending ||
+	    current != &surface->subsurface_list)
+		surface->compositor->view_list_dirty = 1;
 
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
@@ -2853,6 +3299,7 @@ weston_surface_commit_state(struct weston_surface *surface,
 {
 	struct weston_view *view;
 	pixman_region32_t opaque;
+	pixman_region32_t input;
 
 	/* wl_surface.set_buffer_transform */
 	/* wl_surface.set_buffer_scale */
@@ -2860,8 +3307,10 @@ weston_surface_commit_state(struct weston_surface *surface,
 	surface->buffer_viewport = state->buffer_viewport;
 
 	/* wl_surface.attach */
-	if (state->newly_attached)
+	if (state->newly_attached) {
 		weston_surface_attach(surface, state->buffer);
+		surface->flush_pending = true;
+	}
 	weston_surface_state_set_buffer(state, NULL);
 
 	weston_surface_build_buffer_matrix(surface,
@@ -2909,8 +3358,14 @@ weston_surface_commit_state(struct weston_surface *surface,
 	pixman_region32_fini(&opaque);
 
 	/* wl_surface.set_input_region */
-	pixman_region32_intersect_rect(&surface->input, &state->input,
+	pixman_region32_init(&input);
+	pixman_region32_intersect_rect(&input, &state->input,
 				       0, 0, surface->width, surface->height);
+	if (!pixman_region32_equal(&input, &surface->input)) {
+		pixman_region32_copy(&surface->input, &input);
+		surface->compositor->pick_generation++;
+	}
+	pixman_region32_fini(&input);
 
 	/* wl_surface.frame */
 	wl_list_insert_list(&surface->frame_callback_list,
@@ -3308,6 +3763,7 @@ subsurface_configure(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 		surface->output = output;
 		weston_surface_update_output_mask(surface, 1u << output->id);
+		compositor->view_list_dirty = 1;
 	}
 }
 
@@ -3692,6 +4148,7 @@ weston_subsurface_destroy(struct weston_subsurface *sub)
 
 		if (sub->parent)
 			weston_subsurface_unlink_parent(sub);
+		sub->surface->compositor->view_list_dirty = 1;
 
 		weston_surface_state_fini(&sub->cached);
 		weston_buffer_reference(&sub->cached_buffer_ref, NULL);
@@ -3994,6 +4451,7 @@ weston_plane_init(struct weston_plane *plane,
 {
 	pixman_region32_init(&plane->damage);
 	pixman_region32_init(&plane->clip);
+	pixman_region32_init(&plane->opaque);
 	plane->x = x;
 	plane->y = y;
 	plane->compositor = ec;
@@ -4010,6 +4468,7 @@ weston_plane_release(struct weston_plane *plane)
 
 	pixman_region32_fini(&plane->damage);
 	pixman_region32_fini(&plane->clip);
+	pixman_region32_fini(&plane->opaque);
 
 	wl_list_for_each(view, &plane->compositor->view_list, link) {
 		if (view->plane == plane)
@@ -4125,6 +4584,7 @@ weston_output_destroy(struct weston_output *output)
 	free(output->name);
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
+	pixman_region32_fini(&output->damage);
 	output->compositor->output_id_pool &= ~(1u << output->id);
 
 	wl_resource_for_each(resource, &output->resource_list) {
@@ -4318,6 +4778,7 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	weston_output_init_zoom(output);
 
 	weston_output_init_geometry(output, x, y);
+	pixman_region32_init(&output->damage);
 	weston_output_damage(output);
 
 	wl_signal_init(&output->frame_signal);
@@ -4759,6 +5220,10 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 		goto fail;
 
 	wl_list_init(&ec->view_list);
+	ec->view_list_dirty = 1;
+	wl_array_init(&ec->view_list_layers);
+	ec->pick_grid.dirty = 1;
+	ec->pick_generation = 1;
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -4819,6 +5284,8 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	weston_binding_list_destroy_all(&ec->debug_binding_list);
 
 	weston_plane_release(&ec->primary_plane);
+	wl_array_release(&ec->view_list_layers);
+	weston_pick_grid_release(&ec->pick_grid);
 
 	wl_event_loop_destroy(ec->input_loop);
 }
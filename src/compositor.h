@@ -189,6 +189,9 @@ struct weston_output {
 	pixman_region32_t region;
 
 	pixman_region32_t previous_damage;
+	/* Primary plane share of flushed surface damage, waiting for the
+	 * next repaint of the output, in global coordinates */
+	pixman_region32_t damage;
 	int repaint_needed;
 	int repaint_scheduled;
 	struct wl_event_source *repaint_timer;
@@ -380,6 +383,12 @@ struct weston_pointer {
 	uint32_t button_count;
 
 	struct wl_listener output_destroy_listener;
+
+	/* State the last repick after repaint was done in */
+	uint32_t repick_generation;
+	struct weston_view *repick_focus;
+	struct weston_pointer_grab *repick_grab;
+	wl_fixed_t repick_x, repick_y;
 };
 
 
@@ -613,6 +622,8 @@ struct weston_plane {
 	struct weston_compositor *compositor;
 	pixman_region32_t damage; /**< in global coords */
 	pixman_region32_t clip;
+	/* Of the plane's views, while damage is accumulated */
+	pixman_region32_t opaque;
 	int32_t x, y;
 	struct wl_list link;
 };
@@ -701,6 +712,18 @@ struct weston_backend {
 				 struct weston_backend_output_config *config);
 };
 
+/* Views of the view list bucketed into square cells over the outputs'
+ * extents, each cell in view list order. See weston_compositor_pick_view.
+ */
+struct weston_pick_grid {
+	int dirty;
+	/* Changes on every build, views listed carry it */
+	uint32_t serial;
+	pixman_box32_t extents;
+	int cols, rows;
+	struct wl_array *cells;
+};
+
 struct weston_compositor {
 	struct wl_signal destroy_signal;
 
@@ -739,6 +762,13 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;
 	struct wl_list view_list;
+	/* view_list is rebuilt on repaint only when this is set, or when
+	 * layer_list no longer matches view_list_layers */
+	int view_list_dirty;
+	struct wl_array view_list_layers;
+	struct weston_pick_grid pick_grid;
+	/* Changes whenever picking may give another result */
+	uint32_t pick_generation;
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -930,6 +960,15 @@ struct weston_view {
 		struct weston_matrix inverse;
 
 		struct weston_transform position; /* matrix from x, y */
+
+		/* Translation since the view was last repainted. Valid
+		 * only if nothing but the position has changed meanwhile,
+		 * so that backends may move pixels instead of repainting.
+		 */
+		struct {
+			bool valid;
+			int32_t dx, dy;
+		} motion;
 	} transform;
 
 	/*
@@ -947,6 +986,16 @@ struct weston_view {
 
 	/* Per-surface Presentation feedback flags, controlled by backend. */
 	uint32_t psf_flags;
+
+	/* Place in the pick grid, valid while serial matches the grid's:
+	 * index in the view list and the cells listing the view, x2 and
+	 * y2 exclusive. Managed by the compositor.
+	 */
+	struct {
+		uint32_t serial;
+		int order;
+		int x1, y1, x2, y2;
+	} pick;
 };
 
 struct weston_surface_state {
@@ -998,6 +1047,9 @@ struct weston_surface {
 	 */
 	bool touched;
 
+	/* A buffer was attached since the damage was last flushed */
+	bool flush_pending;
+
 	void *renderer_state;
 
 	struct wl_list views;
@@ -311,12 +311,21 @@ usage(int error_code)
 		"  --host=ADDR\t\tThe address to bind\n"
 		"  --port=PORT\t\tThe port to listen on\n"
  		"  --password=PWD\tThe password (auth disabled if not specified)\n"
-		"  --image-compression=[auto_glz|auto_lz|quic|glz|lz|lz4|off]\t\n"
-		"\tThe image compression (lossless). Default is auto_glz\n"
+		"  --image-compression=[adaptive|auto_glz|auto_lz|quic|glz|lz|lz4|off]\t\n"
+		"\tThe image compression (lossless). Default is adaptive, which\n"
+		"\tfollows the link and may also switch wan compression\n"
 		"  --jpeg-wan-compression=[auto|never|always]\t\n"
 		"\tThe wan image compression (lossy for slow links). Default is auto\n"
 		"  --zlib-glz-wan-compression=[auto|never|always]\t\n"
 		"\tThe wan image compression (lossy for slow links). Default is auto\n"
+		"  --refresh-rate=HZ\tThe target frame rate of the output. Default is 60\n"
+		"  --width=WIDTH\t\tWidth of desktop before a client resizes it\n"
+		"  --height=HEIGHT\tHeight of desktop before a client resizes it\n"
+		"  --output-count=COUNT\tCreate multiple outputs\n"
+		"  --surfaces=COUNT\tQXL surfaces per output, more than one keeps\n"
+		"\t\t\tclient windows offscreen. Default is 1\n"
+		"  --render-threads=COUNT\tExtra threads compositing tiles of\n"
+		"\t\t\teach frame. Default is 0\n"
 		"\n");
 #endif
 
@@ -29,23 +29,37 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "pixman-renderer.h"
 #include "shared/helpers.h"
 
 #include <linux/input.h>
 
+/* Buffers painted directly, most recently painted first */
+#define BUFFER_DAMAGE_COUNT 3
+
+struct pixman_buffer_damage {
+	pixman_image_t *image;
+	/* Output damage since the buffer was last painted */
+	pixman_region32_t damage;
+};
+
 struct pixman_output_state {
 	void *shadow_buffer;
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
+	struct pixman_buffer_damage buffer_damage[BUFFER_DAMAGE_COUNT];
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	/* Of a solid fill image, see source_image_copy() */
+	pixman_color_t color;
 	struct weston_buffer_reference buffer_ref;
 
 	struct wl_listener buffer_destroy_listener;
@@ -53,6 +67,27 @@ struct pixman_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* Threads compositing horizontal tiles of the output damage, the
+ * compositor thread takes tiles too.
+ */
+struct pixman_tile_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int n_threads;
+	bool quit;
+
+	/* Repaint being split, changed under the mutex */
+	uint32_t generation;
+	struct weston_output *output;
+	pixman_image_t *target;
+	pixman_region32_t *damage;
+	int n_tiles;
+	int next_tile;
+	int tiles_left;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -60,9 +95,22 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	struct pixman_tile_pool *tile_pool;
+
 	struct wl_signal destroy_signal;
 };
 
+/* What views are drawn into. Tiles are drawn through images of their
+ * own, because compositing sets the clip of the target and the
+ * transform and filter of the source, which must not be shared
+ * between threads.
+ */
+struct pixman_paint {
+	pixman_image_t *target;
+	pixman_image_t *debug_color;
+	bool private_source;
+};
+
 static inline struct pixman_output_state *
 get_output_state(struct weston_output *output)
 {
@@ -315,10 +363,25 @@ composite_clipped(pixman_image_t *src,
 	}
 }
 
+static pixman_image_t *
+source_image_copy(struct pixman_surface_state *ps)
+{
+	if (!pixman_image_get_data(ps->image))
+		return pixman_image_create_solid_fill(&ps->color);
+
+	return pixman_image_create_bits_no_clear(
+			pixman_image_get_format(ps->image),
+			pixman_image_get_width(ps->image),
+			pixman_image_get_height(ps->image),
+			pixman_image_get_data(ps->image),
+			pixman_image_get_stride(ps->image));
+}
+
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
  * \param output The output being painted.
+ * \param paint The target image, and whether the source image is private.
  * \param repaint_output The region to be painted in output coordinates.
  * \param source_clip The region of the source image to use, in source image
  *                    coordinates. If NULL, use the whole source image.
@@ -326,22 +389,28 @@ composite_clipped(pixman_image_t *src,
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       struct pixman_paint *paint,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
 {
-	struct pixman_renderer *pr =
-		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
+	pixman_image_t *src_image;
 	pixman_image_t *mask_image;
 	pixman_color_t mask = { 0, };
 
+	if (paint->private_source)
+		src_image = source_image_copy(ps);
+	else
+		src_image = pixman_image_ref(ps->image);
+	if (!src_image)
+		return;
+
 	/* Clip rendering to the damaged output region */
-	pixman_image_set_clip_region32(po->shadow_image, repaint_output);
+	pixman_image_set_clip_region32(paint->target, repaint_output);
 
 	pixman_renderer_compute_transform(&transform, ev, output);
 
@@ -361,34 +430,36 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	}
 
 	if (source_clip)
-		composite_clipped(ps->image, mask_image, po->shadow_image,
+		composite_clipped(src_image, mask_image, paint->target,
 				  &transform, filter, source_clip);
 	else
-		composite_whole(pixman_op, ps->image, mask_image,
-				po->shadow_image, &transform, filter);
+		composite_whole(pixman_op, src_image, mask_image,
+				paint->target, &transform, filter);
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
+	pixman_image_unref(src_image);
 
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
-	if (pr->repaint_debug)
+	if (paint->debug_color)
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 paint->debug_color, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 paint->target, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (paint->target), /* width */
+					 pixman_image_get_height (paint->target) /* height */);
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+	pixman_image_set_clip_region32 (paint->target, NULL);
 }
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     struct pixman_paint *paint,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -416,8 +487,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 							  view);
 			region_global_to_output(output, &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, paint, &repaint_output,
+				       NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -427,7 +498,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 						  &surface_blend, view);
 		region_global_to_output(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, output, paint, &repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
@@ -438,6 +509,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 struct pixman_paint *paint,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -463,7 +535,7 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_copy(&repaint_output, repaint_global);
 	region_global_to_output(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, output, paint, &repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
@@ -473,6 +545,7 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
+	  struct pixman_paint *paint,
 	  pixman_region32_t *damage) /* in global coordinates */
 {
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
@@ -499,7 +572,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, paint, &repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -508,21 +581,201 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, paint, &repaint);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_surfaces(struct weston_output *output, struct pixman_paint *paint,
+		 pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+			draw_view(view, output, paint, damage);
+}
+
+static pixman_image_t *
+create_debug_color(void)
+{
+	pixman_color_t red = {
+		0x3fff, 0x0000, 0x0000, 0x3fff
+	};
+
+	return pixman_image_create_solid_fill(&red);
+}
+
+/* Tiles are bands of the output in global coordinates. Outputs map
+ * global coordinates one to one, so bands never share target pixels.
+ */
+static void
+repaint_tile(struct weston_output *output, pixman_image_t *target,
+	     pixman_region32_t *damage, int tile, int n_tiles)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_paint paint = { .private_source = true };
+	pixman_region32_t tile_damage;
+	pixman_box32_t *box = pixman_region32_extents(&output->region);
+	int height = box->y2 - box->y1;
+	int y1 = box->y1 + height * tile / n_tiles;
+	int y2 = box->y1 + height * (tile + 1) / n_tiles;
+
+	pixman_region32_init_rect(&tile_damage, box->x1, y1,
+				  box->x2 - box->x1, y2 - y1);
+	pixman_region32_intersect(&tile_damage, &tile_damage, damage);
+	if (!pixman_region32_not_empty(&tile_damage))
+		goto out;
+
+	paint.target = pixman_image_create_bits_no_clear(
+			pixman_image_get_format(target),
+			pixman_image_get_width(target),
+			pixman_image_get_height(target),
+			pixman_image_get_data(target),
+			pixman_image_get_stride(target));
+	if (!paint.target)
+		goto out;
+	if (pr->repaint_debug)
+		paint.debug_color = create_debug_color();
+
+	repaint_surfaces(output, &paint, &tile_damage);
+
+	if (paint.debug_color)
+		pixman_image_unref(paint.debug_color);
+	pixman_image_unref(paint.target);
+out:
+	pixman_region32_fini(&tile_damage);
+}
+
+/* Takes tiles of the current repaint until there are none left. Called
+ * and returns with the pool mutex held.
+ */
+static void
+tile_pool_work(struct pixman_tile_pool *pool)
+{
+	int tile;
+
+	while (pool->next_tile < pool->n_tiles) {
+		tile = pool->next_tile++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		repaint_tile(pool->output, pool->target, pool->damage,
+			     tile, pool->n_tiles);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->tiles_left == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+}
+
+static void *
+tile_pool_thread(void *data)
+{
+	struct pixman_tile_pool *pool = data;
+	uint32_t generation = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->quit && pool->generation == generation)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		if (pool->quit)
+			break;
+
+		generation = pool->generation;
+		tile_pool_work(pool);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+repaint_surfaces_tiled(struct pixman_tile_pool *pool,
+		       struct weston_output *output,
+		       pixman_image_t *target,
+		       pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_view *view;
+
+	/* Surface states are created lazily, not by the tile threads */
+	wl_list_for_each(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane)
+			get_surface_state(view->surface);
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->output = output;
+	pool->target = target;
+	pool->damage = damage;
+	pool->n_tiles = 2 * (pool->n_threads + 1);
+	pool->next_tile = 0;
+	pool->tiles_left = pool->n_tiles;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	tile_pool_work(pool);
+	while (pool->tiles_left > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pool->output = NULL;
+	pool->target = NULL;
+	pool->damage = NULL;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+tile_pool_destroy(struct pixman_tile_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->n_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+static struct pixman_tile_pool *
+tile_pool_create(int n_threads)
+{
+	struct pixman_tile_pool *pool;
+
+	pool = zalloc(sizeof *pool);
+	if (pool == NULL)
+		return NULL;
+
+	pool->threads = calloc(n_threads, sizeof *pool->threads);
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (pool->n_threads = 0; pool->n_threads < n_threads;
+	     pool->n_threads++) {
+		if (pthread_create(&pool->threads[pool->n_threads], NULL,
+				   tile_pool_thread, pool) != 0) {
+			weston_log("Failed to start pixman tile thread: %m\n");
+			tile_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
 }
 
 static void
@@ -552,17 +805,82 @@ copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
 }
 
+/* Adds to the damage what the buffer missed since it was last painted,
+ * then adds the damage to what the other buffers miss. A buffer which
+ * is not tracked yet is painted whole and takes the slot of the least
+ * recently painted one.
+ */
+static void
+output_get_buffer_damage(struct weston_output *output,
+			 pixman_region32_t *output_damage,
+			 pixman_region32_t *buffer_damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_buffer_damage last;
+	int i, n;
+
+	for (n = 0; n < BUFFER_DAMAGE_COUNT; n++)
+		if (po->buffer_damage[n].image == po->hw_buffer)
+			break;
+
+	if (n == BUFFER_DAMAGE_COUNT) {
+		n = BUFFER_DAMAGE_COUNT - 1;
+		if (po->buffer_damage[n].image)
+			pixman_image_unref(po->buffer_damage[n].image);
+		po->buffer_damage[n].image = pixman_image_ref(po->hw_buffer);
+		pixman_region32_copy(buffer_damage, &output->region);
+	} else {
+		pixman_region32_union(buffer_damage, output_damage,
+				      &po->buffer_damage[n].damage);
+	}
+	pixman_region32_clear(&po->buffer_damage[n].damage);
+
+	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
+		if (i != n && po->buffer_damage[i].image)
+			pixman_region32_union(&po->buffer_damage[i].damage,
+					      &po->buffer_damage[i].damage,
+					      output_damage);
+
+	last = po->buffer_damage[n];
+	memmove(&po->buffer_damage[1], &po->buffer_damage[0],
+		n * sizeof po->buffer_damage[0]);
+	po->buffer_damage[0] = last;
+}
+
 static void
 pixman_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_paint paint = {
+		.debug_color = pr->repaint_debug ? pr->debug_color : NULL,
+		.private_source = false,
+	};
+	pixman_region32_t buffer_damage;
 
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	pixman_region32_init(&buffer_damage);
+	if (po->shadow_image) {
+		paint.target = po->shadow_image;
+		pixman_region32_copy(&buffer_damage, output_damage);
+	} else {
+		paint.target = po->hw_buffer;
+		output_get_buffer_damage(output, output_damage,
+					 &buffer_damage);
+	}
+
+	if (pr->tile_pool)
+		repaint_surfaces_tiled(pr->tile_pool, output, paint.target,
+				       &buffer_damage);
+	else
+		repaint_surfaces(output, &paint, &buffer_damage);
+
+	if (po->shadow_image)
+		copy_to_hw_buffer(output, &buffer_damage);
+	pixman_region32_fini(&buffer_damage);
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -734,6 +1052,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -750,6 +1069,8 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+	if (pr->tile_pool)
+		tile_pool_destroy(pr->tile_pool);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -812,11 +1133,7 @@ debug_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color = create_debug_color();
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -860,6 +1177,38 @@ pixman_renderer_init(struct weston_compositor *ec)
 	return 0;
 }
 
+/** Composite outputs with a pool of threads
+ *
+ * \param ec The compositor using the pixman renderer.
+ * \param n_threads Threads besides the compositor one, 0 to composite
+ *                  on the compositor thread only.
+ *
+ * Damage of every repaint is split into horizontal tiles, each drawn
+ * with the whole view list clipped to it. Repaint returns when all
+ * tiles are done.
+ */
+WL_EXPORT int
+pixman_renderer_set_tile_threads(struct weston_compositor *ec, int n_threads)
+{
+	struct pixman_renderer *pr = get_renderer(ec);
+
+	if (pr->tile_pool) {
+		tile_pool_destroy(pr->tile_pool);
+		pr->tile_pool = NULL;
+	}
+
+	if (n_threads <= 0)
+		return 0;
+
+	pr->tile_pool = tile_pool_create(n_threads);
+	if (!pr->tile_pool)
+		return -1;
+
+	weston_log("Pixman renderer composites with %d extra threads\n",
+		   n_threads);
+	return 0;
+}
+
 WL_EXPORT void
 pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *buffer)
 {
@@ -875,37 +1224,53 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 	}
 }
 
+/** Create the renderer state of an output
+ *
+ * \param output The output, with its current mode set.
+ * \param flags PIXMAN_RENDERER_OUTPUT_USE_SHADOW to composite into a
+ *              shadow image copied to the buffer afterwards.
+ *
+ * Without a shadow, views are composited straight into the buffers given
+ * to pixman_renderer_output_set_buffer(), which must be of the mode size
+ * and cheap to read. A backend may swap between several such buffers,
+ * each is repainted with what it missed since it was last painted.
+ */
 WL_EXPORT int
-pixman_renderer_output_create(struct weston_output *output)
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags)
 {
 	struct pixman_output_state *po;
-	int w, h;
+	int w, h, i;
 
 	po = zalloc(sizeof *po);
 	if (po == NULL)
 		return -1;
 
-	/* set shadow image transformation */
-	w = output->current_mode->width;
-	h = output->current_mode->height;
+	if (flags & PIXMAN_RENDERER_OUTPUT_USE_SHADOW) {
+		/* set shadow image transformation */
+		w = output->current_mode->width;
+		h = output->current_mode->height;
 
-	po->shadow_buffer = malloc(w * h * 4);
+		po->shadow_buffer = malloc(w * h * 4);
 
-	if (!po->shadow_buffer) {
-		free(po);
-		return -1;
-	}
+		if (!po->shadow_buffer) {
+			free(po);
+			return -1;
+		}
 
-	po->shadow_image =
-		pixman_image_create_bits(PIXMAN_x8r8g8b8, w, h,
-					 po->shadow_buffer, w * 4);
+		po->shadow_image =
+			pixman_image_create_bits(PIXMAN_x8r8g8b8, w, h,
+						 po->shadow_buffer, w * 4);
 
-	if (!po->shadow_image) {
-		free(po->shadow_buffer);
-		free(po);
-		return -1;
+		if (!po->shadow_image) {
+			free(po->shadow_buffer);
+			free(po);
+			return -1;
+		}
 	}
 
+	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
+		pixman_region32_init(&po->buffer_damage[i].damage);
+
 	output->renderer_state = po;
 
 	return 0;
@@ -915,12 +1280,20 @@ WL_EXPORT void
 pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
+	int i;
 
-	pixman_image_unref(po->shadow_image);
+	if (po->shadow_image)
+		pixman_image_unref(po->shadow_image);
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
 
+	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++) {
+		if (po->buffer_damage[i].image)
+			pixman_image_unref(po->buffer_damage[i].image);
+		pixman_region32_fini(&po->buffer_damage[i].damage);
+	}
+
 	free(po->shadow_buffer);
 
 	po->shadow_buffer = NULL;
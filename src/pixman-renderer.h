@@ -31,7 +31,14 @@ int
 pixman_renderer_init(struct weston_compositor *ec);
 
 int
-pixman_renderer_output_create(struct weston_output *output);
+pixman_renderer_set_tile_threads(struct weston_compositor *ec, int n_threads);
+
+enum pixman_renderer_output_flags {
+	PIXMAN_RENDERER_OUTPUT_USE_SHADOW = (1 << 0),
+};
+
+int
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags);
 
 void
 pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *buffer);
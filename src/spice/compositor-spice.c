@@ -23,9 +23,12 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <errno.h>
 #include <sys/time.h>
 
 #include <spice.h>
@@ -33,8 +36,12 @@
 #include <spice/macros.h>
 
 #include "compositor-spice.h"
+#include "presentation_timing-server-protocol.h"
 #include "weston_basic_event_loop.h"
 #include "weston_qxl_commands.h"
+#include "weston_qxl_moves.h"
+#include "weston_qxl_surfaces.h"
+#include "weston_qxl_video.h"
 
 struct spice_backend_config {
     const char* addr;
@@ -44,6 +51,17 @@ struct spice_backend_config {
     char *image_compression;
     char *jpeg_wan_compression;
     char *zlib_glz_wan_compression;
+    int refresh_rate;
+    int width;
+    int height;
+    int output_count;
+    int num_surfaces;
+    int render_threads;
+};
+/* Window on the surface plane, box is in output coordinates */
+struct spice_surface_view {
+    struct spice_surface *ss;
+    pixman_box32_t box;
 };
 struct spice_output {
     struct weston_output base;
@@ -51,47 +69,925 @@ struct spice_output {
 
     struct weston_mode mode;
 
-    int has_spice_surface;
-    uint32_t spice_surface_id;
+    struct spice_display display;
     uint8_t *surface;
 
-    uint32_t full_image_id;
     pixman_image_t *full_image;
 
-    struct SpiceTimer *wakeup_timer;
+    struct spice_snapshot *snapshots[NUM_SNAPSHOTS];
+    int next_snapshot;
+
+    uint32_t skipped_frames;
+    /* Frame damage which could not be sent, left in the primary plane */
+    int damage_pending;
+
+    struct SpiceTimer *frame_timer;
+    int wait_drain;
+    /* Monotonic ns drawables of the frame were pushed, 0 if none */
+    uint64_t frame_nsec;
+
+    /* Pointer sprite goes to the client's cursor channel */
+    struct weston_plane cursor_plane;
+    struct weston_view *cursor_view;
+    int cursor_visible;
+    uint64_t cursor_unique;
+    int32_t cursor_x, cursor_y;
+
+    /* Windows drawn from their offscreen surfaces, top first */
+    struct weston_plane surface_plane;
+    struct spice_surface_view surface_views[MAX_SURFACES];
+    int surface_view_count;
+    /* Previous frame's ones, to find what has moved */
+    struct spice_surface_view last_surface_views[MAX_SURFACES];
+    int last_surface_view_count;
+    pixman_region32_t surface_region;
+    /* To be drawn again from surfaces, output coordinates */
+    pixman_region32_t surface_dirty;
+    int surfaces_pending;
+
+    /* Client damage of the frame which may be scrolled content */
+    pixman_region32_t scrolls;
+
+    struct spice_videos videos;
 };
 
 
+/* Frame is presented when red_worker has taken the last of its
+ * drawables, the time it did is reported. Frames which did not draw
+ * anything are reported with the current time.
+ */
+static void
+spice_output_finish_frame (struct spice_output *output)
+{
+    struct timespec ts;
+    uint64_t consumed = __atomic_load_n (&output->display.consumed_nsec,
+            __ATOMIC_RELAXED);
+    uint32_t flags = 0;
+
+    output->wait_drain = FALSE;
+    /* Motion held back during the frame makes the next one */
+    weston_spice_mouse_flush (output->backend);
+    if (output->frame_nsec != 0 && consumed >= output->frame_nsec) {
+        ts.tv_sec = consumed / 1000000000;
+        ts.tv_nsec = consumed % 1000000000;
+        flags = PRESENTATION_FEEDBACK_KIND_HW_COMPLETION;
+    } else {
+        weston_compositor_read_presentation_clock(output->base.compositor,
+                &ts);
+    }
+    output->frame_nsec = 0;
+    weston_output_finish_frame (&output->base, &ts, flags);
+    /* Coalesced damage is sent as soon as worker catches up, even if
+     * nothing is damaged meanwhile.
+     */
+    if (output->skipped_frames > 0 || output->damage_pending ||
+            output->surfaces_pending)
+    {
+        weston_output_schedule_repaint (&output->base);
+    }
+}
+
 static void
 spice_output_start_repaint_loop(struct weston_output *output_base)
 {
     struct spice_output *output = (struct spice_output*) output_base;
     struct spice_backend *b  = output->backend;
+    struct timespec ts;
+
+    if (!b->vm_running) {
+        spice_server_vm_start(b->spice_server);
+        b->vm_running = TRUE;
+    }
+
+    weston_compositor_read_presentation_clock(b->compositor, &ts);
+    weston_output_finish_frame(output_base, &ts,
+            PRESENTATION_FEEDBACK_INVALID);
+}
+/* Returns snapshot which is not referenced by red_worker anymore.
+ * Snapshots are allocated on demand, so a mostly static output never
+ * gets more than one of them.
+ */
+static struct spice_snapshot *
+spice_output_get_snapshot (struct spice_output *output)
+{
+    struct spice_snapshot **slot;
+    int i;
+
+    for (i = 0; i < NUM_SNAPSHOTS; ++i) {
+        slot = &output->snapshots[
+            (output->next_snapshot + i) % NUM_SNAPSHOTS];
+        if (*slot != NULL && !spice_snapshot_is_busy (*slot)) {
+            goto found;
+        }
+    }
+    for (i = 0; i < NUM_SNAPSHOTS; ++i) {
+        slot = &output->snapshots[
+            (output->next_snapshot + i) % NUM_SNAPSHOTS];
+        if (*slot == NULL) {
+            *slot = spice_snapshot_create (
+                    output->base.current_mode->width,
+                    output->base.current_mode->height);
+            if (*slot != NULL) {
+                goto found;
+            }
+        }
+    }
+    return NULL;
+
+found:
+    output->next_snapshot = (output->next_snapshot + i + 1) % NUM_SNAPSHOTS;
+    return *slot;
+}
+
+/* Drops output's references, snapshots still used by red_worker are
+ * freed on release.
+ */
+static void
+spice_output_release_snapshots (struct spice_output *output)
+{
+    int i;
+
+    for (i = 0; i < NUM_SNAPSHOTS; ++i) {
+        if (output->snapshots[i] != NULL) {
+            spice_snapshot_unref (output->snapshots[i]);
+            output->snapshots[i] = NULL;
+        }
+    }
+}
+
+/* Copies only damaged part of the rendered frame */
+static void
+spice_output_take_snapshot (struct spice_output *output,
+        struct spice_snapshot *snapshot, pixman_region32_t *damage)
+{
+    pixman_region32_t region;
+
+    pixman_region32_init (&region);
+    pixman_region32_copy (&region, damage);
+    pixman_region32_translate (&region, -output->base.x, -output->base.y);
+
+    pixman_image_set_clip_region32 (snapshot->image, &region);
+    pixman_image_composite32 (PIXMAN_OP_SRC,
+            output->full_image, NULL, snapshot->image,
+            0, 0, 0, 0, 0, 0,
+            pixman_image_get_width (snapshot->image),
+            pixman_image_get_height (snapshot->image));
+    pixman_image_set_clip_region32 (snapshot->image, NULL);
+
+    pixman_region32_fini (&region);
+}
+
+/* Damage is sent as its extents when it has too many boxes. Windows of
+ * the surface plane those cover are drawn again on top of it.
+ */
+static void
+spice_output_reduce_damage (struct spice_output *output,
+        pixman_region32_t *damage)
+{
+    pixman_region32_t covered;
+
+    spice_damage_reduce (damage);
+
+    pixman_region32_init (&covered);
+    pixman_region32_copy (&covered, damage);
+    pixman_region32_translate (&covered, -output->base.x, -output->base.y);
+    pixman_region32_intersect (&covered, &covered, &output->surface_region);
+    pixman_region32_union (&output->surface_dirty,
+            &output->surface_dirty, &covered);
+    pixman_region32_fini (&covered);
+}
+
+static struct weston_plane *
+spice_output_prepare_cursor_view (struct spice_output *output,
+        struct weston_view *ev)
+{
+    struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+    struct weston_pointer *pointer =
+        weston_seat_get_pointer (&output->backend->core_seat);
+    struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+
+    if (pointer == NULL || pointer->sprite != ev) {
+        return NULL;
+    }
+    if (ev->transform.enabled &&
+            (ev->transform.matrix.type > WESTON_MATRIX_TRANSFORM_TRANSLATE))
+    {
+        return NULL;
+    }
+    if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+            output->base.current_scale != 1 ||
+            viewport->buffer.scale != 1)
+    {
+        return NULL;
+    }
+    /* Cursor channel can show it on a single display only */
+    if (ev->output_mask != (1u << output->base.id)) {
+        return NULL;
+    }
+    if (ev->geometry.scissor_enabled) {
+        return NULL;
+    }
+    if (buffer == NULL || buffer->shm_buffer == NULL ||
+            wl_shm_buffer_get_format (buffer->shm_buffer) !=
+            WL_SHM_FORMAT_ARGB8888)
+    {
+        return NULL;
+    }
+    if (ev->surface->width > MAX_CURSOR_SIZE ||
+            ev->surface->height > MAX_CURSOR_SIZE)
+    {
+        return NULL;
+    }
+
+    output->cursor_view = ev;
+    return &output->cursor_plane;
+}
+
+/* Opaque shm windows shown as they are go to offscreen surfaces */
+static struct weston_plane *
+spice_output_prepare_surface_view (struct spice_output *output,
+        struct weston_view *ev)
+{
+    struct weston_surface *es = ev->surface;
+    struct weston_buffer *buffer = es->buffer_ref.buffer;
+    struct weston_buffer_viewport *viewport = &es->buffer_viewport;
+    struct spice_surface_view *sv;
+    struct spice_surface *ss;
+    pixman_box32_t rect = { 0, 0, es->width, es->height };
+    uint32_t format;
+
+    if (output->backend->num_surfaces <= 1 ||
+            output->surface_view_count >= MAX_SURFACES)
+    {
+        return NULL;
+    }
+    if (ev->output_mask != (1u << output->base.id)) {
+        return NULL;
+    }
+    if (ev->transform.enabled &&
+            (ev->transform.matrix.type > WESTON_MATRIX_TRANSFORM_TRANSLATE))
+    {
+        return NULL;
+    }
+    if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+            output->base.current_scale != 1 ||
+            viewport->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+            viewport->buffer.scale != 1 ||
+            viewport->buffer.src_width != wl_fixed_from_int (-1) ||
+            viewport->surface.width != -1)
+    {
+        return NULL;
+    }
+    if (ev->geometry.scissor_enabled) {
+        return NULL;
+    }
+    if (buffer == NULL || buffer->shm_buffer == NULL ||
+            wl_shm_buffer_get_width (buffer->shm_buffer) != es->width ||
+            wl_shm_buffer_get_height (buffer->shm_buffer) != es->height)
+    {
+        return NULL;
+    }
+    if (es->width < MIN_SURFACE_SIZE || es->height < MIN_SURFACE_SIZE) {
+        return NULL;
+    }
+    /* red_worker draws surfaces without blending */
+    format = wl_shm_buffer_get_format (buffer->shm_buffer);
+    if (ev->alpha != 1.0 ||
+            (format != WL_SHM_FORMAT_XRGB8888 &&
+             (format != WL_SHM_FORMAT_ARGB8888 ||
+              pixman_region32_contains_rectangle (&es->opaque, &rect) !=
+              PIXMAN_REGION_IN)))
+    {
+        return NULL;
+    }
+
+    ss = spice_surface_get (&output->display, es);
+    if (ss == NULL) {
+        return NULL;
+    }
+    /* Surface damage is flushed right after planes are assigned */
+    pixman_region32_union (&ss->damage, &ss->damage, &es->damage);
+
+    sv = &output->surface_views[output->surface_view_count++];
+    sv->ss = ss;
+    sv->box = *pixman_region32_extents (&ev->transform.boundingbox);
+    sv->box.x1 -= output->base.x;
+    sv->box.x2 -= output->base.x;
+    sv->box.y1 -= output->base.y;
+    sv->box.y2 -= output->base.y;
+
+    return &output->surface_plane;
+}
+
+/* Anything moved, restacked, appeared or gone on the surface plane is
+ * drawn again from surfaces. Where windows have left, primary plane
+ * shows through again.
+ */
+static void
+spice_output_update_surface_region (struct spice_output *output)
+{
+    struct weston_compositor *ec = output->base.compositor;
+    struct spice_surface_view *sv, *last;
+    pixman_region32_t region, exposed;
+    int i, changed;
+
+    pixman_region32_init (&region);
+    for (i = 0; i < output->surface_view_count; ++i) {
+        sv = &output->surface_views[i];
+        pixman_region32_union_rect (&region, &region,
+                sv->box.x1, sv->box.y1,
+                sv->box.x2 - sv->box.x1, sv->box.y2 - sv->box.y1);
+    }
+    /* Boxes of windows partly off the output are not clipped, drawables
+     * have to be
+     */
+    pixman_region32_intersect_rect (&region, &region,
+            0, 0, output->base.width, output->base.height);
+
+    changed = output->surface_view_count != output->last_surface_view_count;
+    for (i = 0; !changed && i < output->surface_view_count; ++i) {
+        sv = &output->surface_views[i];
+        last = &output->last_surface_views[i];
+        changed = sv->ss != last->ss ||
+            sv->box.x1 != last->box.x1 || sv->box.y1 != last->box.y1 ||
+            sv->box.x2 != last->box.x2 || sv->box.y2 != last->box.y2;
+    }
+    if (changed) {
+        pixman_region32_union (&output->surface_dirty,
+                &output->surface_dirty, &output->surface_region);
+        pixman_region32_union (&output->surface_dirty,
+                &output->surface_dirty, &region);
+    }
+
+    pixman_region32_init (&exposed);
+    pixman_region32_subtract (&exposed, &output->surface_region, &region);
+    pixman_region32_translate (&exposed, output->base.x, output->base.y);
+    pixman_region32_union (&ec->primary_plane.damage,
+            &ec->primary_plane.damage, &exposed);
+    pixman_region32_fini (&exposed);
+
+    pixman_region32_copy (&output->surface_region, &region);
+    pixman_region32_fini (&region);
+
+    memcpy (output->last_surface_views, output->surface_views,
+            output->surface_view_count * sizeof output->surface_views[0]);
+    output->last_surface_view_count = output->surface_view_count;
+}
+
+/* Same for every output, a view on several must not flip-flop */
+static int
+spice_view_may_leave_primary (struct spice_backend *b,
+        struct weston_view *ev)
+{
+    struct weston_surface *es = ev->surface;
+    struct weston_buffer *buffer = es->buffer_ref.buffer;
+    struct weston_pointer *pointer = weston_seat_get_pointer (&b->core_seat);
+
+    if (buffer == NULL || buffer->shm_buffer == NULL) {
+        return FALSE;
+    }
+    if (pointer != NULL && pointer->sprite == ev) {
+        return es->width <= MAX_CURSOR_SIZE && es->height <= MAX_CURSOR_SIZE;
+    }
+    return b->num_surfaces > 1 &&
+        es->width >= MIN_SURFACE_SIZE && es->height >= MIN_SURFACE_SIZE;
+}
+
+static void
+spice_output_assign_planes (struct weston_output *output_base)
+{
+    struct spice_output *output = (struct spice_output *) output_base;
+    struct weston_compositor *ec = output_base->compositor;
+    struct weston_plane *primary = &ec->primary_plane;
+    struct weston_plane *next_plane;
+    struct weston_view *ev;
+    pixman_region32_t overlap, surface_overlap;
+    int video;
+
+    pixman_region32_init (&overlap);
+    output->cursor_view = NULL;
+    output->surface_view_count = 0;
+    pixman_region32_clear (&output->scrolls);
+    spice_videos_begin (&output->videos);
+
+    wl_list_for_each(ev, &ec->view_list, link) {
+        /* Sprites and windows are read from their buffers after they
+         * left the primary plane. Others let clients have them back.
+         */
+        ev->surface->keep_buffer =
+            spice_view_may_leave_primary (output->backend, ev);
+
+        /* Views of other outputs are their business */
+        if (!(ev->output_mask & (1u << output_base->id))) {
+            continue;
+        }
+
+        /* Streams are made of primary surface drawables only */
+        video = spice_videos_track (&output->videos, output_base, ev);
+
+        pixman_region32_init (&surface_overlap);
+        pixman_region32_intersect (&surface_overlap, &overlap,
+                &ev->transform.boundingbox);
+
+        next_plane = NULL;
+        if (!pixman_region32_not_empty (&surface_overlap)) {
+            next_plane = spice_output_prepare_cursor_view (output, ev);
+            if (next_plane == NULL && !video) {
+                next_plane = spice_output_prepare_surface_view (output, ev);
+            }
+        }
+        if (next_plane == NULL) {
+            next_plane = primary;
+            pixman_region32_union (&overlap, &overlap,
+                    &ev->transform.boundingbox);
+            if (!video) {
+                spice_moves_track_view (&output->scrolls, output_base, ev);
+            }
+        }
+        weston_view_move_to_plane (ev, next_plane);
+        ev->psf_flags = 0;
+
+        pixman_region32_fini (&surface_overlap);
+    }
+    pixman_region32_fini (&overlap);
+
+    spice_display_surfaces_collect (&output->display);
+    spice_output_update_surface_region (output);
+}
+
+/* Sends the sprite chosen by assign_planes. Its shape goes only when
+ * it has changed, otherwise a move costs one tiny command.
+ */
+static int
+spice_output_update_cursor (struct spice_output *output)
+{
+    struct spice_display *display = &output->display;
+    struct weston_view *ev = output->cursor_view;
+    struct weston_pointer *pointer;
+    struct wl_shm_buffer *shm_buffer;
+    const uint8_t *data;
+    int32_t stride;
+    uint64_t unique;
+    float fx, fy;
+    int x, y, width, height;
+    int pushed = FALSE;
+
+    if (ev == NULL) {
+        if (output->cursor_visible && spice_cursor_hide (display) == 0) {
+            output->cursor_visible = FALSE;
+            pushed = TRUE;
+        }
+        return pushed;
+    }
+
+    pointer = weston_seat_get_pointer (&output->backend->core_seat);
+    weston_view_to_global_float (ev, 0, 0, &fx, &fy);
+    x = (int)fx + pointer->hotspot_x - output->base.x;
+    y = (int)fy + pointer->hotspot_y - output->base.y;
+
+    if (!output->cursor_visible ||
+            pixman_region32_not_empty (&output->cursor_plane.damage))
+    {
+        pixman_region32_fini (&output->cursor_plane.damage);
+        pixman_region32_init (&output->cursor_plane.damage);
+
+        shm_buffer = ev->surface->buffer_ref.buffer->shm_buffer;
+        width = ev->surface->width;
+        height = ev->surface->height;
+        stride = wl_shm_buffer_get_stride (shm_buffer);
+
+        wl_shm_buffer_begin_access (shm_buffer);
+        data = wl_shm_buffer_get_data (shm_buffer);
+        unique = spice_cursor_unique (data, stride, width, height,
+                pointer->hotspot_x, pointer->hotspot_y);
+        /* Plane is damaged by moves as well, most of the time
+         * the shape is the same.
+         */
+        if ((!output->cursor_visible || unique != output->cursor_unique) &&
+                spice_cursor_set (display, data, stride, width, height,
+                    pointer->hotspot_x, pointer->hotspot_y,
+                    x, y, unique) == 0)
+        {
+            output->cursor_visible = TRUE;
+            output->cursor_unique = unique;
+            output->cursor_x = x;
+            output->cursor_y = y;
+            pushed = TRUE;
+        }
+        wl_shm_buffer_end_access (shm_buffer);
+    }
+
+    if (output->cursor_visible &&
+            (x != output->cursor_x || y != output->cursor_y) &&
+            spice_cursor_move (display, x, y) == 0)
+    {
+        output->cursor_x = x;
+        output->cursor_y = y;
+        pushed = TRUE;
+    }
+    return pushed;
+}
+
+/* Moved content goes as QXL_COPY_BITS, only what the copies do not
+ * cover is left in damage to be sent as pixels. Moves are released by
+ * the caller, bitmaps take row hashes from them.
+ */
+static void
+spice_output_send_moves (struct spice_output *output,
+        struct spice_moves *moves, pixman_region32_t *damage)
+{
+    struct spice_move *move;
+    pixman_box32_t *dest;
+    pixman_region32_t moved;
+    int i, count;
+
+    pixman_region32_init (&moved);
+    count = spice_moves_finish (moves, output->full_image);
+    for (i = 0; i < count; ++i) {
+        move = &moves->moves[i];
+        dest = &move->dest;
+        if (spice_copy_bits (&output->display, dest,
+                    dest->x1 - move->dx, dest->y1 - move->dy) < 0)
+        {
+            continue;
+        }
+        pixman_region32_union_rect (&moved, &moved,
+                output->base.x + dest->x1, output->base.y + dest->y1,
+                dest->x2 - dest->x1, dest->y2 - dest->y1);
+    }
+
+    pixman_region32_subtract (damage, damage, &moved);
+    pixman_region32_fini (&moved);
+}
+
+/* Uploads windows' damage to their surfaces and draws what has changed
+ * onto the primary surface, bottom window first. Windows are opaque, so
+ * a window is drawn only where none above covers it.
+ */
+static int
+spice_output_paint_surfaces (struct spice_output *output)
+{
+    struct spice_backend *b = output->backend;
+    struct spice_surface_view *sv;
+    struct spice_surface *ss;
+    pixman_region32_t sent, drawn, region, above;
+    pixman_box32_t *boxes;
+    int i, j, n_boxes;
+    int pushed = FALSE;
+
+    pixman_region32_fini (&output->surface_plane.damage);
+    pixman_region32_init (&output->surface_plane.damage);
+
+    output->surfaces_pending = FALSE;
+    pixman_region32_init (&drawn);
+    for (i = output->surface_view_count - 1; i >= 0; --i) {
+        sv = &output->surface_views[i];
+        ss = sv->ss;
+        if (b->commands_free (&output->display) < 2 * MAX_DAMAGE_BOXES ||
+                b->over_budget (&output->display))
+        {
+            /* Whatever is dirty is drawn again next frame */
+            output->surfaces_pending = TRUE;
+            break;
+        }
+
+        pixman_region32_init (&sent);
+        if (spice_surface_upload (ss, &sent) == 0 &&
+                pixman_region32_not_empty (&sent))
+        {
+            pixman_region32_translate (&sent, sv->box.x1, sv->box.y1);
+            pixman_region32_intersect (&sent, &sent,
+                    &output->surface_region);
+            pixman_region32_union (&output->surface_dirty,
+                    &output->surface_dirty, &sent);
+            pushed = TRUE;
+        }
+        pixman_region32_fini (&sent);
+
+        pixman_region32_init (&above);
+        for (j = 0; j < i; ++j) {
+            pixman_region32_union_rect (&above, &above,
+                    output->surface_views[j].box.x1,
+                    output->surface_views[j].box.y1,
+                    output->surface_views[j].box.x2 -
+                    output->surface_views[j].box.x1,
+                    output->surface_views[j].box.y2 -
+                    output->surface_views[j].box.y1);
+        }
+        pixman_region32_init (&region);
+        pixman_region32_union (&region, &output->surface_dirty, &drawn);
+        pixman_region32_intersect_rect (&region, &region,
+                sv->box.x1, sv->box.y1,
+                sv->box.x2 - sv->box.x1, sv->box.y2 - sv->box.y1);
+        pixman_region32_intersect (&region, &region,
+                &output->surface_region);
+        pixman_region32_subtract (&region, &region, &above);
+
+        boxes = pixman_region32_rectangles (&region, &n_boxes);
+        if (n_boxes > MAX_DAMAGE_BOXES) {
+            boxes = pixman_region32_extents (&region);
+            n_boxes = 1;
+            /* Extents may cover windows above, they draw it again */
+            pixman_region32_union_rect (&drawn, &drawn,
+                    boxes->x1, boxes->y1,
+                    boxes->x2 - boxes->x1, boxes->y2 - boxes->y1);
+        }
+        for (j = 0; j < n_boxes; ++j) {
+            if (spice_draw_surface (&output->display, ss->id,
+                        ss->width, ss->height, &boxes[j],
+                        boxes[j].x1 - sv->box.x1,
+                        boxes[j].y1 - sv->box.y1) == 0)
+            {
+                pushed = TRUE;
+            }
+        }
+        pixman_region32_fini (&region);
+        pixman_region32_fini (&above);
+    }
+    pixman_region32_fini (&drawn);
+
+    if (!output->surfaces_pending) {
+        pixman_region32_fini (&output->surface_dirty);
+        pixman_region32_init (&output->surface_dirty);
+    }
+    return pushed;
+}
+
+/* Moves damage of videos from damage to video, which gets their whole
+ * boxes. Both are in global coordinates.
+ */
+static void
+spice_output_split_videos (struct spice_output *output,
+        pixman_region32_t *damage, pixman_region32_t *video)
+{
+    pixman_box32_t *box;
+    int i;
+
+    for (i = 0; i < output->videos.count; ++i) {
+        box = &output->videos.boxes[i];
+        /* Whole box would be drawn over windows of the surface plane */
+        if (pixman_region32_contains_rectangle (&output->surface_region,
+                    box) != PIXMAN_REGION_OUT)
+        {
+            continue;
+        }
+        if (pixman_region32_contains_rectangle (damage, &(pixman_box32_t) {
+                    output->base.x + box->x1, output->base.y + box->y1,
+                    output->base.x + box->x2, output->base.y + box->y2 }) ==
+                PIXMAN_REGION_OUT)
+        {
+            continue;
+        }
+        pixman_region32_union_rect (video, video,
+                output->base.x + box->x1, output->base.y + box->y1,
+                box->x2 - box->x1, box->y2 - box->y1);
+    }
+    pixman_region32_subtract (damage, damage, video);
+}
 
-    spice_server_vm_start(b->spice_server);
-    b->core->timer_start(b->primary_output->wakeup_timer, 5);
+/* Every damaged video goes as one drawable of its whole box */
+static int
+spice_output_paint_videos (struct spice_output *output,
+        struct spice_snapshot *snapshot, pixman_region32_t *video)
+{
+    pixman_box32_t *box;
+    pixman_box32_t frame_box;
+    int i;
+    int ret = 0;
+
+    for (i = 0; i < output->videos.count; ++i) {
+        box = &output->videos.boxes[i];
+        frame_box.x1 = output->base.x + box->x1;
+        frame_box.y1 = output->base.y + box->y1;
+        frame_box.x2 = output->base.x + box->x2;
+        frame_box.y2 = output->base.y + box->y2;
+        if (pixman_region32_contains_rectangle (video, &frame_box) !=
+                PIXMAN_REGION_IN)
+        {
+            continue;
+        }
+        if (spice_paint_video (&output->display, snapshot, box) < 0) {
+            ret = -1;
+        }
+    }
+    return ret;
 }
+
 static int
 spice_output_repaint (struct weston_output *output_base,
         pixman_region32_t *damage)
 {
     struct spice_output *output = (struct spice_output *) output_base;
     struct spice_backend *b = output->backend;
+    struct weston_compositor *ec = output->base.compositor;
+    struct spice_snapshot *snapshot = NULL;
+    struct spice_moves moves;
+    pixman_region32_t remaining, covered, video;
+    int use_moves;
+    int pushed = FALSE, drawn = FALSE;
+    int ret = 0;
+    /* Before the first push: red_worker may drain the ring while the
+     * frame is still being pushed
+     */
+    uint64_t start_nsec = spice_get_monotonic_nsec ();
+
+    output->display.frame_mm_time = spice_get_mm_time (b);
+    if (spice_output_update_cursor (output)) {
+        pushed = TRUE;
+    }
+
+    /* Worker is behind the compositor or holds too much: leave damage
+     * in the primary plane so it is coalesced into the next frame
+     * instead of blocking here.
+     */
+    if (pixman_region32_not_empty (damage) &&
+            (b->commands_free (&output->display) <
+                MAX_DAMAGE_BOXES + MAX_SPICE_MOVES + MAX_SPICE_VIDEOS ||
+             b->over_budget (&output->display) ||
+             (snapshot = spice_output_get_snapshot (output)) == NULL))
+    {
+        if (output->skipped_frames++ == 0) {
+            weston_log ("Spice worker is behind, coalescing frames\n");
+        }
+        goto out;
+    }
+    output->skipped_frames = 0;
+    output->damage_pending = FALSE;
+
+    /* Frame has no window pixels where surfaces are drawn, copies of
+     * it would be wrong there.
+     */
+    use_moves = snapshot != NULL && output->surface_view_count == 0;
+    if (use_moves) {
+        spice_moves_prepare (&moves, output_base, output->full_image,
+                damage, &output->scrolls);
+    }
+
+    ec->renderer->repaint_output (output_base, damage);
+    output->display.frame_mm_time = spice_get_mm_time (b);
+
+    if (snapshot != NULL) {
+        pixman_region32_init (&remaining);
+        pixman_region32_copy (&remaining, damage);
+        pixman_region32_init (&video);
+        spice_output_split_videos (output, &remaining, &video);
+        if (use_moves) {
+            spice_output_send_moves (output, &moves, &remaining);
+        } else {
+            pixman_region32_init (&covered);
+            pixman_region32_copy (&covered, &output->surface_region);
+            pixman_region32_translate (&covered,
+                    output_base->x, output_base->y);
+            pixman_region32_subtract (&remaining, &remaining, &covered);
+            pixman_region32_fini (&covered);
+        }
+        spice_output_reduce_damage (output, &remaining);
+
+        spice_output_take_snapshot (output, snapshot, &remaining);
+        spice_output_take_snapshot (output, snapshot, &video);
+        ret = spice_paint_image (&output->display,
+                output_base->x,
+                output_base->y,
+                output_base->width,
+                output_base->height,
+                snapshot,
+                &remaining,
+                use_moves ? &moves : NULL);
+        if (use_moves) {
+            spice_moves_release (&moves);
+        }
+        if (spice_output_paint_videos (output, snapshot, &video) < 0) {
+            ret = -1;
+        }
+        drawn = TRUE;
+        pixman_region32_fini (&video);
+        pixman_region32_fini (&remaining);
+    }
+    if (spice_output_paint_surfaces (output)) {
+        drawn = TRUE;
+    }
+
+    /* Boxes after a failed one are missing from the client: the whole
+     * damage is sent again next frame.
+     */
+    if (ret < 0) {
+        output->damage_pending = TRUE;
+    } else {
+        pixman_region32_subtract (&ec->primary_plane.damage,
+                &ec->primary_plane.damage, damage);
+    }
+
+out:
+    if (drawn) {
+        output->frame_nsec = start_nsec;
+    }
+    if (pushed || drawn) {
+        spice_qxl_wakeup(&output->display.display_sin);
+    }
+    /* Congested link gets fewer frames */
+    b->core->timer_start (output->frame_timer,
+            1000000 / output->mode.refresh * b->compression.frame_divider);
+    return ret;
+}
+
+static struct weston_mode *
+spice_output_ensure_mode (struct spice_output *output, int width, int height)
+{
+    struct weston_mode *mode;
+
+    wl_list_for_each(mode, &output->base.mode_list, link) {
+        if (mode->width == width && mode->height == height) {
+            return mode;
+        }
+    }
+
+    mode = zalloc (sizeof *mode);
+    if (mode == NULL) {
+        return NULL;
+    }
+    mode->width = width;
+    mode->height = height;
+    mode->refresh = output->mode.refresh;
+    wl_list_insert(output->base.mode_list.prev, &mode->link);
+
+    return mode;
+}
+
+/* Reallocates everything sized to the mode: primary surface, renderer
+ * shadow and the frame. Snapshots are dropped and lazily reallocated,
+ * the ones still read by red_worker are freed on release.
+ */
+static int
+spice_output_switch_mode (struct weston_output *output_base,
+        struct weston_mode *target)
+{
+    struct spice_output *output = (struct spice_output*) output_base;
+    struct weston_mode *mode, *old_mode = output_base->current_mode;
+    pixman_image_t *full_image;
+    uint8_t *surface;
+    int width = target->width;
+    int height = target->height;
 
-    output->base.compositor->renderer->repaint_output (output_base, damage);
+    if (width <= 0 || height <= 0 ||
+            width > MAX_OUTPUT_SIZE || height > MAX_OUTPUT_SIZE)
+    {
+        return -EINVAL;
+    }
 
-    if (output->full_image_id == 0) {
-        output->full_image_id = spice_create_image(b);
+    mode = spice_output_ensure_mode (output, width, height);
+    if (mode == NULL) {
+        return -ENOMEM;
+    }
+    if (mode == output->base.current_mode) {
+        return 0;
     }
 
-    return spice_paint_image (b, output->full_image_id,
-            output_base->x,
-            output_base->y,
-            output_base->width,
-            output_base->height,
-            (intptr_t)pixman_image_get_data(output->full_image),
-            output_base->width * 4,
-            damage );
+    surface = calloc (width * height, 4);
+    if (surface == NULL) {
+        goto err_surface_malloc;
+    }
+    full_image = pixman_image_create_bits ( PIXMAN_a8r8g8b8,
+            width, height, NULL, width*4 );
+    if (full_image == NULL) {
+        goto err_image_malloc;
+    }
+
+    output->base.current_mode->flags &= ~WL_OUTPUT_MODE_CURRENT;
+    output->base.current_mode = mode;
+    mode->flags |= WL_OUTPUT_MODE_CURRENT;
+
+    pixman_renderer_output_destroy (output_base);
+    if (pixman_renderer_output_create (output_base, 0) < 0) {
+        goto err_pixman_create;
+    }
+    pixman_renderer_output_set_buffer (output_base, full_image);
+    pixman_image_unref (output->full_image);
+    output->full_image = full_image;
+
+    spice_reset_primary_surface (&output->display, width, height, surface);
+    free (output->surface);
+    output->surface = surface;
+
+    spice_output_release_snapshots (output);
+
+    weston_log ("Spice output %s switched to %dx%d\n",
+            output_base->name, width, height);
+    return 0;
+
+err_pixman_create:
+    /* Get back to the old mode with the old frame */
+    mode->flags &= ~WL_OUTPUT_MODE_CURRENT;
+    output->base.current_mode = old_mode;
+    old_mode->flags |= WL_OUTPUT_MODE_CURRENT;
+    if (pixman_renderer_output_create (output_base, 0) == 0) {
+        pixman_renderer_output_set_buffer (output_base, output->full_image);
+    }
+    pixman_image_unref (full_image);
+err_image_malloc:
+    free (surface);
+err_surface_malloc:
+    weston_log ("Failed to switch spice output to %dx%d\n", width, height);
+    return -ENOMEM;
 }
 
 static void
@@ -99,36 +995,106 @@ spice_output_destroy ( struct weston_output *output_base)
 {
     struct spice_output *output = (struct spice_output*) output_base;
     struct spice_backend *b = output->backend;
+    struct weston_mode *mode, *next;
+
+    b->core->timer_cancel (output->frame_timer);
+    b->core->timer_remove (output->frame_timer);
+
+    /* Release queued commands while snapshots are still alive */
+    weston_spice_qxl_destroy (&output->display);
+    spice_display_surfaces_destroy (&output->display);
+    spice_display_commands_destroy (&output->display);
+    spice_videos_release (&output->videos);
+    weston_plane_release (&output->cursor_plane);
+    weston_plane_release (&output->surface_plane);
+    pixman_region32_fini (&output->surface_region);
+    pixman_region32_fini (&output->surface_dirty);
+    pixman_region32_fini (&output->scrolls);
+
+    pixman_renderer_output_destroy (output_base);
+    pixman_image_unref (output->full_image);
+    spice_output_release_snapshots (output);
+
+    wl_list_for_each_safe(mode, next, &output->base.mode_list, link) {
+        if (mode != &output->mode) {
+            wl_list_remove (&mode->link);
+            free (mode);
+        }
+    }
 
-    b->core->timer_cancel (output->wakeup_timer);
-    b->core->timer_remove (output->wakeup_timer);
-
-    free ( pixman_image_get_destroy_data(output->full_image));
-    free (output->full_image);
+    weston_output_destroy (output_base);
+    free (output->surface);
+    free (output);
 }
 
+/* Frame period is over. The frame is done as soon as red_worker has
+ * taken everything pushed so far, there is nothing to poll meanwhile.
+ */
 static void
-on_wakeup (void *opaque) {
+on_frame_timer (void *opaque)
+{
     struct spice_output *output = (struct spice_output *)opaque;
     struct spice_backend *b = output->backend;
-	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(b->compositor, &ts);
+    spice_compression_sample (b, &output->display, output->frame_nsec);
+    if (!b->request_drain (&output->display)) {
+        output->wait_drain = TRUE;
+        return;
+    }
+    spice_output_finish_frame (output);
+}
+
+/* Client asked for another resolution, e.g. its window was resized */
+static int
+spice_client_monitors_config (struct spice_display *display,
+        int width, int height)
+{
+    struct spice_output *output = wl_container_of(display, output, display);
+    struct weston_mode *mode;
+
+    if (width <= 0 || height <= 0) {
+        return FALSE;
+    }
+    width = MIN (width, MAX_OUTPUT_SIZE);
+    height = MIN (height, MAX_OUTPUT_SIZE);
+    if (output->base.current_mode->width == width &&
+            output->base.current_mode->height == height)
+    {
+        return TRUE;
+    }
+
+    /* Output keeps it as its native mode */
+    mode = spice_output_ensure_mode (output, width, height);
+    if (mode == NULL) {
+        return FALSE;
+    }
+    if (weston_output_mode_set_native (&output->base, mode,
+                output->base.current_scale) < 0)
+    {
+        return FALSE;
+    }
+    weston_output_damage (&output->base);
+    return TRUE;
+}
 
-    b->core->timer_start (output->wakeup_timer, 1);
-    spice_qxl_wakeup(&b->display_sin);
+static void
+spice_commands_drained (struct spice_display *display)
+{
+    struct spice_output *output = wl_container_of(display, output, display);
 
-    weston_output_finish_frame (&output->base, &ts, 0);
-    weston_output_schedule_repaint (&output->base);
+    if (output->wait_drain) {
+        spice_output_finish_frame (output);
+    }
 }
 
 static struct spice_output *
 spice_create_output ( struct spice_backend *b,
-        int x, int y,
-        int width, int height,
+        const char *name, int x, int y,
+        int width, int height, int refresh_rate,
         uint32_t transform )
 {
     struct spice_output *output;
+    char default_name[16];
 
     if (b->core == NULL) {
         goto err_core_interface;
@@ -151,30 +1117,42 @@ spice_create_output ( struct spice_backend *b,
         goto err_image_malloc;
     }
 
-    output->spice_surface_id =
-        spice_create_primary_surface (b, width, height,
+    output->display.backend = b;
+    if (spice_display_commands_init (&output->display) < 0) {
+        goto err_display_commands;
+    }
+    spice_display_surfaces_init (&output->display);
+    spice_videos_init (&output->videos);
+    if (weston_spice_qxl_init (&output->display) < 0) {
+        goto err_qxl;
+    }
+    spice_create_primary_surface (&output->display, width, height,
             output->surface);
 
-    output->full_image_id = spice_create_image (b);
-
-    output->has_spice_surface = FALSE;
     output->backend = b;
 	output->mode.flags =
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = width;
 	output->mode.height = height;
-	output->mode.refresh = 6;
+	output->mode.refresh = refresh_rate * 1000;
 	wl_list_init(&output->base.mode_list);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
+    if (name == NULL) {
+        snprintf (default_name, sizeof default_name, "SPICE%d",
+                output->display.display_sin.id);
+        name = default_name;
+    }
+    output->base.name = strdup (name);
+
     //output->base.origin         = output->base.current;
     output->base.start_repaint_loop = spice_output_start_repaint_loop;
     output->base.repaint            = spice_output_repaint;
     output->base.destroy            = spice_output_destroy;
-    output->base.assign_planes      = NULL;
+    output->base.assign_planes      = spice_output_assign_planes;
 	output->base.set_backlight      = NULL;
 	output->base.set_dpms           = NULL;
-	output->base.switch_mode        = NULL;
+	output->base.switch_mode        = spice_output_switch_mode;
 
     output->base.current_mode       = &output->mode;
     output->base.make               = "none";
@@ -182,25 +1160,60 @@ spice_create_output ( struct spice_backend *b,
 
     weston_output_init ( &output->base, b->compositor,
                 x, y, width, height, transform, 1 );
-    if( pixman_renderer_output_create (&output->base) <0) {
+    if( pixman_renderer_output_create (&output->base, 0) <0) {
         goto err_pixman_create;
     }
     pixman_renderer_output_set_buffer (&output->base, output->full_image);
-    wl_list_insert(b->compositor->output_list.prev, &output->base.link);
 
-    output->wakeup_timer = b->core->timer_add(on_wakeup, output);
-    if (output->wakeup_timer == NULL) {
+    /* Planes are stacked on top, so the cursor is above windows */
+    weston_plane_init (&output->surface_plane, b->compositor, 0, 0);
+    weston_compositor_stack_plane (b->compositor, &output->surface_plane,
+            NULL);
+    weston_plane_init (&output->cursor_plane, b->compositor, 0, 0);
+    weston_compositor_stack_plane (b->compositor, &output->cursor_plane,
+            NULL);
+    pixman_region32_init (&output->surface_region);
+    pixman_region32_init (&output->surface_dirty);
+    pixman_region32_init (&output->scrolls);
+
+    output->frame_timer = b->core->timer_add(on_frame_timer, output);
+    if (output->frame_timer == NULL) {
         goto err_timer;
     }
+    wl_list_insert(b->compositor->output_list.prev, &output->base.link);
 
-    weston_log ("Spice output created on (%d,%d), width: %d, height: %d\n",
-                x,y,width,height);
+    weston_log ("Spice output %s created on (%d,%d), "
+                "width: %d, height: %d\n",
+                output->base.name, x, y, width, height);
 
     return output;
 
 err_timer:
+    pixman_region32_fini (&output->scrolls);
+    pixman_region32_fini (&output->surface_dirty);
+    pixman_region32_fini (&output->surface_region);
+    weston_plane_release (&output->cursor_plane);
+    weston_plane_release (&output->surface_plane);
+    pixman_renderer_output_destroy (&output->base);
 err_pixman_create:
-    free (output->full_image);
+    weston_output_destroy (&output->base);
+    spice_qxl_destroy_primary_surface (&output->display.display_sin,
+            PRIMARY_SURFACE_ID);
+    /* Display and everything it points to are red_worker's as long as
+     * the QXL instance is in the server.
+     */
+    if (weston_spice_qxl_remove (&output->display) < 0) {
+        weston_log ("Spice display %d stays in the session, "
+                "leaking it\n", output->display.display_sin.id);
+        goto err_output_malloc;
+    }
+    weston_spice_qxl_destroy (&output->display);
+err_qxl:
+    spice_videos_release (&output->videos);
+    spice_display_surfaces_destroy (&output->display);
+    spice_display_commands_destroy (&output->display);
+err_display_commands:
+    pixman_image_unref (output->full_image);
 err_image_malloc:
     free (output->surface);
 err_surface_malloc:
@@ -211,6 +1224,125 @@ err_core_interface:
     return NULL;
 }
 
+/* Creates an output for every [output] section named SPICE*, placed
+ * left to right, then unconfigured ones up to --output-count.
+ */
+/* Number of outputs spice_create_outputs makes */
+static int
+spice_count_outputs (const struct spice_backend_config *config,
+        struct weston_config *wconfig)
+{
+    struct weston_config_section *section = NULL;
+    const char *section_name;
+    char *name;
+    int count = 0;
+
+    if (config->output_count > 0) {
+        return config->output_count;
+    }
+    while (weston_config_next_section(wconfig, &section, &section_name)) {
+        if (strcmp(section_name, "output") != 0) {
+            continue;
+        }
+        weston_config_section_get_string(section, "name", &name, NULL);
+        if (name != NULL && strncmp(name, "SPICE", 5) == 0) {
+            count++;
+        }
+        free(name);
+    }
+    return MAX (count, 1);
+}
+
+static int
+spice_create_outputs (struct spice_backend *b,
+        const struct spice_backend_config *config,
+        struct weston_config *wconfig)
+{
+    struct weston_config_section *section = NULL;
+    struct spice_output *output;
+    const char *section_name;
+    char *name, *mode, *t;
+    int width, height, refresh_rate;
+    int x = 0, output_count = 0;
+    uint32_t transform;
+
+    /* Tablet positions come without the display they are on, they can
+     * only be mapped when there is one. Otherwise primaries do not
+     * allow client mouse mode and the pointer stays relative.
+     */
+    b->client_mouse = spice_count_outputs (config, wconfig) == 1;
+
+    while (weston_config_next_section(wconfig, &section, &section_name)) {
+        if (strcmp(section_name, "output") != 0) {
+            continue;
+        }
+        weston_config_section_get_string(section, "name", &name, NULL);
+        if (name == NULL || strncmp(name, "SPICE", 5) != 0) {
+            free(name);
+            continue;
+        }
+
+        width = config->width;
+        height = config->height;
+        refresh_rate = config->refresh_rate;
+        weston_config_section_get_string(section, "mode", &mode, NULL);
+        if (mode != NULL &&
+                (sscanf(mode, "%dx%d@%d", &width, &height,
+                        &refresh_rate) < 2 ||
+                 width <= 0 || height <= 0 ||
+                 width > MAX_OUTPUT_SIZE || height > MAX_OUTPUT_SIZE ||
+                 refresh_rate <= 0 || refresh_rate > 1000))
+        {
+            weston_log("Invalid mode \"%s\" for output %s\n",
+                    mode, name);
+            width = config->width;
+            height = config->height;
+            refresh_rate = config->refresh_rate;
+        }
+        free(mode);
+
+        /* Frame, snapshots and damage sent are all in mode
+         * coordinates, nothing maps a rotated output to them.
+         */
+        weston_config_section_get_string(section,
+                "transform", &t, "normal");
+        if (weston_parse_transform(t, &transform) < 0 ||
+                transform != WL_OUTPUT_TRANSFORM_NORMAL)
+        {
+            weston_log("Unsupported transform \"%s\" for output %s, "
+                    "using normal\n", t, name);
+            transform = WL_OUTPUT_TRANSFORM_NORMAL;
+        }
+        free(t);
+
+        output = spice_create_output (b, name, x, 0,
+                width, height, refresh_rate, transform);
+        free(name);
+        if (output == NULL) {
+            return -1;
+        }
+        x = pixman_region32_extents(&output->base.region)->x2;
+
+        if (++output_count >= config->output_count &&
+                config->output_count > 0)
+        {
+            break;
+        }
+    }
+
+    while (output_count < config->output_count || output_count == 0) {
+        output = spice_create_output (b, NULL, x, 0,
+                config->width, config->height, config->refresh_rate,
+                WL_OUTPUT_TRANSFORM_NORMAL);
+        if (output == NULL) {
+            return -1;
+        }
+        x = pixman_region32_extents(&output->base.region)->x2;
+        output_count++;
+    }
+    return 0;
+}
+
 /* This will find corresponding integer representation of spice's compression
  * type by it's string representation or return -1. This function is
  * case insensitive.
@@ -275,9 +1407,11 @@ static int
 weston_spice_server_new (struct spice_backend *b,
         const struct spice_backend_config *config)
 {
-    /* Choose image compression */
+    /* Choose image compression, adaptive one starts with auto_glz */
     spice_image_compression_t compression = SPICE_IMAGE_COMPRESS_AUTO_GLZ;
-    if (config->image_compression) {
+    int adaptive = config->image_compression == NULL ||
+        strcasecmp (config->image_compression, "adaptive") == 0;
+    if (!adaptive) {
         compression = parse_spice_image_compression_name(
                 config->image_compression);
         if (compression == SPICE_IMAGE_COMPRESS_INVALID) {
@@ -286,8 +1420,12 @@ weston_spice_server_new (struct spice_backend *b,
             return -1;
         }
     }
-    weston_log("Setting image compression to '%s'\n",
-            image_compression_names[compression]);
+    weston_log("Setting image compression to '%s'%s\n",
+            image_compression_names[compression],
+            adaptive ? ", adaptive" : "");
+    spice_compression_init (&b->compression, adaptive,
+            config->jpeg_wan_compression != NULL,
+            config->zlib_glz_wan_compression != NULL);
 
     spice_wan_compression_t jpeg_wan_compr = SPICE_WAN_COMPRESSION_AUTO;
     if (config->jpeg_wan_compression) {
@@ -327,14 +1465,18 @@ weston_spice_server_new (struct spice_backend *b,
     spice_server_set_image_compression(b->spice_server, compression);
     spice_server_set_jpeg_compression(b->spice_server, jpeg_wan_compr);
     spice_server_set_zlib_glz_compression(b->spice_server, zlib_glz_wan_compr);
-    spice_server_set_agent_mouse(b->spice_server, 0);
+    /* Client mouse mode, absolute positions go to the tablet */
+    spice_server_set_agent_mouse(b->spice_server, 1);
 
     //TODO set another spice server options here
     spice_server_init (b->spice_server, b->core);
 
-    //qxl interface
-    weston_spice_qxl_init (b);
-    spice_server_add_interface (b->spice_server, &b->display_sin.base);
+    //qxl interfaces are added along with outputs
+    if (spice_qxl_commands_init (b) < 0) {
+        spice_server_destroy (b->spice_server);
+        b->spice_server = NULL;
+        return -1;
+    }
 
     return 0;
 }
@@ -346,7 +1488,9 @@ weston_spice_input_init (struct spice_backend *b,
     weston_seat_init (&b->core_seat, b->compositor, "default");
 
     //mouse interface
-    weston_spice_mouse_init (b);
+    if (weston_spice_mouse_init (b) < 0) {
+        return -1;
+    }
 
     //keyboard interface
     if ( weston_spice_kbd_init (b) < 0) {
@@ -360,22 +1504,27 @@ spice_destroy (struct weston_compositor *ec)
 {
     struct spice_backend *b = (struct spice_backend*) ec->backend;
 
-    weston_compositor_shutdown (ec);
-
-    //ec->renderer->destroy(ec);
+    /* Stop workers, so outputs can release their queued commands
+     * while being destroyed.
+     */
     spice_server_vm_stop(b->spice_server);
 
-    /* TODO: after calling next line double free detect.
-     * recognize, why?
+    /* Server goes first: red_workers release the drawables they keep
+     * while being destroyed, and those point into outputs and pools.
+     * Its watches and timers are removed through the core, which is
+     * released last.
      */
-    //spice_server_destroy(b->spice_server);
+    spice_server_destroy(b->spice_server);
+
+    weston_compositor_shutdown (ec);
+
+    //ec->renderer->destroy(ec);
 
     weston_spice_mouse_destroy (b);
     weston_spice_kbd_destroy (b);
-    weston_spice_qxl_destroy (b);
-
-    free (b->primary_output->surface);
-    free (b->primary_output);
+    spice_qxl_commands_destroy (b);
+    basic_event_loop_destroy (b->core, b->core_source);
+    free (b);
 }
 
 static void
@@ -390,6 +1539,7 @@ spice_backend_create (struct weston_compositor *compositor,
         struct weston_config *wconfig )
 {
     struct spice_backend *b;
+    struct weston_output *output, *next;
 
     b = zalloc(sizeof *b);
     if ( b == NULL ) {
@@ -399,11 +1549,20 @@ spice_backend_create (struct weston_compositor *compositor,
     b->compositor = compositor;
     b->base.destroy = spice_destroy;
     b->base.restore = spice_restore;
+    b->commands_drained = spice_commands_drained;
+    b->client_monitors_config = spice_client_monitors_config;
+    b->num_surfaces = config->num_surfaces;
 
-	if (weston_compositor_set_presentation_clock_software(compositor) < 0)
+	/* Frames are timed by red_worker's consumption, see finish_frame */
+	if (weston_compositor_set_presentation_clock(compositor,
+				CLOCK_MONOTONIC) < 0)
 		goto err_compositor;
 	if (pixman_renderer_init(compositor) < 0)
 		goto err_compositor;
+    if (pixman_renderer_set_tile_threads (compositor,
+                config->render_threads) < 0) {
+        weston_log ("Compositing on the compositor thread only\n");
+    }
 #if 0
     if (weston_compositor_init (&b->base, display, argc, argv, config) < 0)
     {
@@ -413,7 +1572,10 @@ spice_backend_create (struct weston_compositor *compositor,
 
 	compositor->capabilities |= WESTON_CAP_ARBITRARY_MODES;
 
-    b->core = basic_event_loop_init(compositor);
+    b->core = basic_event_loop_init(compositor, &b->core_source);
+    if (b->core == NULL) {
+        goto err_compositor;
+    }
     if (weston_spice_server_new (b, config) < 0) {
         goto err_server;
     }
@@ -425,11 +1587,7 @@ spice_backend_create (struct weston_compositor *compositor,
         goto err_input_init;
     }
 
-    b->primary_output = spice_create_output(b, 0, 0, //(x,y)
-                MAX_WIDTH, MAX_HEIGHT, //WIDTH x HEIGTH
-                WL_OUTPUT_TRANSFORM_NORMAL); //transform
-
-    if (b->primary_output == NULL ) {
+    if (spice_create_outputs (b, config, wconfig) < 0) {
         goto err_output;
     }
     compositor->backend = &b->base;
@@ -437,8 +1595,20 @@ spice_backend_create (struct weston_compositor *compositor,
 
 err_output:
 err_input_init:
-err_compositor:
+    /* Same order as spice_destroy: workers of the outputs created so
+     * far release into outputs and pools, the core goes last
+     */
+    spice_server_vm_stop (b->spice_server);
+    spice_server_destroy (b->spice_server);
+    wl_list_for_each_safe (output, next, &compositor->output_list, link) {
+        output->destroy (output);
+    }
+    weston_spice_mouse_destroy (b);
+    weston_spice_kbd_destroy (b);
+    spice_qxl_commands_destroy (b);
 err_server:
+    basic_event_loop_destroy (b->core, b->core_source);
+err_compositor:
     free (b);
     return NULL;
 }
@@ -457,6 +1627,12 @@ backend_init(struct weston_compositor *compositor, int *argc, char *argv[],
         .image_compression = NULL,
         .jpeg_wan_compression = NULL,
         .zlib_glz_wan_compression = NULL,
+        .refresh_rate = DEFAULT_REFRESH_RATE,
+        .width = DEFAULT_WIDTH,
+        .height = DEFAULT_HEIGHT,
+        .output_count = 0,
+        .num_surfaces = NUM_SURFACES,
+        .render_threads = 0,
     };
 
     const struct weston_option spice_options[] = {
@@ -466,9 +1642,40 @@ backend_init(struct weston_compositor *compositor, int *argc, char *argv[],
 		{ WESTON_OPTION_STRING,  "image-compression", 0, &config.image_compression },
 		{ WESTON_OPTION_STRING,  "jpeg-wan-compression", 0, &config.jpeg_wan_compression },
 		{ WESTON_OPTION_STRING,  "zlib-glz-wan-compression", 0, &config.zlib_glz_wan_compression },
+		{ WESTON_OPTION_INTEGER, "refresh-rate", 0, &config.refresh_rate },
+		{ WESTON_OPTION_INTEGER, "width", 0, &config.width },
+		{ WESTON_OPTION_INTEGER, "height", 0, &config.height },
+		{ WESTON_OPTION_INTEGER, "output-count", 0, &config.output_count },
+		{ WESTON_OPTION_INTEGER, "surfaces", 0, &config.num_surfaces },
+		{ WESTON_OPTION_INTEGER, "render-threads", 0, &config.render_threads },
 	};
 
     parse_options (spice_options, ARRAY_LENGTH (spice_options), argc, argv);
+    if (config.refresh_rate <= 0 || config.refresh_rate > 1000) {
+        weston_log ("Invalid refresh rate %d\n", config.refresh_rate);
+        return -1;
+    }
+    if (config.width <= 0 || config.height <= 0 ||
+            config.width > MAX_OUTPUT_SIZE ||
+            config.height > MAX_OUTPUT_SIZE)
+    {
+        weston_log ("Invalid output size %dx%d\n",
+                config.width, config.height);
+        return -1;
+    }
+    if (config.output_count < 0 || config.output_count > 32) {
+        weston_log ("Invalid output count %d\n", config.output_count);
+        return -1;
+    }
+    if (config.num_surfaces < 1 || config.num_surfaces > MAX_SURFACES) {
+        weston_log ("Invalid surface count %d\n", config.num_surfaces);
+        return -1;
+    }
+    if (config.render_threads < 0 || config.render_threads > 64) {
+        weston_log ("Invalid render thread count %d\n",
+                config.render_threads);
+        return -1;
+    }
     weston_log ("Initialising spice compositor\n");
     b = spice_backend_create (compositor, &config, argc, argv, wconfig);
     if (b == NULL ) {
@@ -476,9 +1683,3 @@ backend_init(struct weston_compositor *compositor, int *argc, char *argv[],
     }
     return 0;
 }
-
-uint32_t
-spice_get_primary_surface_id (struct spice_backend *b)
-{
-    return b->primary_output->spice_surface_id;
-}
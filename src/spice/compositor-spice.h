@@ -24,6 +24,8 @@
 #define COMPOSITOR_SPICE_H
 
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
 #include <spice.h>
 
 #include "shared/helpers.h"
@@ -31,21 +33,129 @@
 #include "pixman-renderer.h"
 
 #include "weston_spice_interfaces.h"
+#include "weston_qxl_pool.h"
+#include "weston_qxl_compression.h"
+
+struct spice_image_cache;
 
 #define NUM_MEMSLOTS        1
 #define NUM_MEMSLOTS_GROUPS 1
-#define NUM_SURFACES        2
+/* Surfaces per QXL instance by default: only the primary one, client
+ * windows are composited into it. --surfaces raises it up to
+ * MAX_SURFACES, so windows may be kept in offscreen surfaces.
+ */
+#define NUM_SURFACES        1
+#define MAX_SURFACES        64
 #define MEMSLOT_ID_BITS     1
 #define MEMSLOT_GEN_BITS    1
 
 #define MEMSLOT_GROUP 0
 
-#define MAX_WIDTH 1024
-#define MAX_HEIGHT 480
+/* Every QXL instance has its own surface namespace */
+#define PRIMARY_SURFACE_ID 0
+
+/* Capacity of the command ring, must be power of two */
+#define MAX_COMMAND_NUM 1024
+
+/* Same for every display's cursor ring */
+#define MAX_CURSOR_COMMAND_NUM 16
+
+/* Preallocated commands. Every frame pushes drawables, so their pool
+ * covers the whole ring. Cursor commands are rare.
+ */
+#define IMAGE_POOL_SIZE     MAX_COMMAND_NUM
+#define DRAWABLE_POOL_SIZE  (MAX_COMMAND_NUM / 4)
+#define CURSOR_POOL_SIZE    MAX_CURSOR_COMMAND_NUM
+
+/* Larger sprites are composited into the frame */
+#define MAX_CURSOR_SIZE 64
+
+/* Smaller windows are composited into the frame as well */
+#define MIN_SURFACE_SIZE 64
+
+#define DEFAULT_WIDTH 1024
+#define DEFAULT_HEIGHT 480
+
+/* Keeps width * height * 4 of frame buffers within an int */
+#define MAX_OUTPUT_SIZE 8192
+
+#define DEFAULT_REFRESH_RATE 60
+
+/* Frames which may be in flight between renderer and red_worker */
+#define NUM_SNAPSHOTS 3
+
+/* Per display budget of pushed and not yet released commands and their
+ * bitmaps. Above it frames are coalesced and red_worker is asked to
+ * give memory back. Drawables stay in red_worker's tree until they are
+ * overdrawn, so what is in flight is mostly what the client sees: the
+ * bytes hold a 2560x1600 screen four times over, the commands a full
+ * ring besides the drawables kept.
+ */
+#define MAX_INFLIGHT_COMMANDS   (2 * MAX_COMMAND_NUM)
+#define MAX_INFLIGHT_BYTES      (64 << 20)
+
+/* Out of memory is repeated while red_worker gives nothing back, every
+ * frame or so. When it has not helped a few times frames are pushed
+ * anyway, overdrawn drawables are released.
+ */
+#define RECLAIM_RETRY_MSEC      16
+#define RECLAIM_MAX_RETRIES     8
+
+/* Release latencies, ms, counted one by one; longer ones go to the
+ * last bucket
+ */
+#define RELEASE_HISTOGRAM_SIZE  1000
+
+/* Spice state is kept per backend. Several backends, each with its
+ * own server, port, outputs and seat, may live in one process and
+ * share the event loop core (see weston_basic_event_loop.c).
+ */
 
-/* TODO: is it necessary to support
- * several instances of spice_backend?
+/* QXL device shown to the client as a separate display channel.
+ * Every spice output owns one, with its own red_worker, command ring
+ * and primary surface, so outputs are painted independently.
  */
+struct spice_display {
+    struct spice_backend *backend;
+
+    QXLInstance display_sin;
+    QXLWorker *worker;
+    weston_spice_qxl_t *qxl;
+
+    struct spice_pool cursor_pool;
+
+    /* Offscreen surfaces, ids 1..num_surfaces-1 */
+    struct wl_list surfaces;
+    uint32_t free_surfaces[MAX_SURFACES];
+    int free_surface_count;
+
+    /* Written by red_worker, taken by the compression controller */
+    int compression_level;
+
+    /* mm_time of drawables being pushed, taken when the frame was
+     * rendered
+     */
+    uint32_t frame_mm_time;
+    /* Monotonic ns red_worker took the last pushed command at */
+    uint64_t consumed_nsec;
+
+    /* Pushed and not released yet, changed atomically */
+    uint32_t inflight_commands;
+    uint64_t inflight_bytes;
+    /* Released since the last flush_resources */
+    uint32_t released;
+    int reclaiming;
+    /* Commands in flight and time of the last out of memory */
+    uint32_t reclaim_commands;
+    uint32_t reclaim_msec;
+    int reclaim_retries;
+
+    /* Statistics: bitmap bytes ever pushed, and release latencies if
+     * somebody has set the histogram (spice-bench does)
+     */
+    uint64_t pushed_bytes;
+    uint32_t *release_histogram;
+};
 
 struct spice_backend {
     struct weston_backend base;
@@ -53,26 +163,70 @@ struct spice_backend {
 
     SpiceServer *spice_server;
 
-    QXLInstance display_sin;
-
     SpiceCoreInterface *core;
-    SpiceTimer *wakeup_timer;
-    QXLWorker *worker;
-    uint32_t mm_clock;
+    struct wl_event_source *core_source;
+    int vm_running;
+    /* Last server mm_time in the high half, monotonic ms it was set
+     * at in the low one, so both are read at once
+     */
+    uint64_t mm_clock;
+    int display_count;
+    int num_surfaces;
+    /* Primaries allow client mouse mode, see spice_create_outputs */
+    int client_mouse;
 
-    struct spice_output *primary_output;
     struct weston_seat core_seat;
 
     weston_spice_mouse_t *mouse;
     weston_spice_kbd_t *kbd;
-    weston_spice_qxl_t *qxl;
+
+    struct spice_pool image_pool;
+    struct spice_pool drawable_pool;
+    struct spice_image_cache *image_cache;
+
+    struct spice_compression compression;
 
     void (*produce_command) (struct spice_backend*);
-    int (*push_command) (struct spice_backend*, QXLCommandExt *);
+    int (*push_command) (struct spice_display*, QXLCommandExt *);
+    int (*push_cursor_command) (struct spice_display*, QXLCommandExt *);
+    int (*commands_free) (struct spice_display*);
+    int (*request_drain) (struct spice_display*);
+    int (*over_budget) (struct spice_display*);
+    void (*commands_drained) (struct spice_display*);
+    int (*client_monitors_config) (struct spice_display*,
+            int width, int height);
     void (*release_resource) (struct spice_backend*, QXLCommandExt *);
 };
 
-uint32_t
-spice_get_primary_surface_id (struct spice_backend *c);
+/* Work in both compositor and red_worker threads. CLOCK_MONOTONIC is
+ * the presentation clock of the backend and the one spice-server runs
+ * its mm_time by.
+ */
+static inline uint64_t
+spice_get_monotonic_nsec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint32_t
+spice_get_monotonic_msec (void)
+{
+    return spice_get_monotonic_nsec () / 1000000;
+}
+
+/* Server resynchronises mm_time only now and then, in between it runs
+ * along with the monotonic clock.
+ */
+static inline uint32_t
+spice_get_mm_time (struct spice_backend *b)
+{
+    uint64_t clock = __atomic_load_n (&b->mm_clock, __ATOMIC_ACQUIRE);
+
+    return (uint32_t)(clock >> 32) +
+        (spice_get_monotonic_msec () - (uint32_t)clock);
+}
 
 #endif //COMPOSITOR_SPICE_H
@@ -0,0 +1,566 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Benchmark and soak test of the spice command path. Scripted damage
+ * is painted, snapshotted and pushed the way spice_output_repaint does
+ * it, to a real red_worker. No compositor and no client are needed, the
+ * server listens on loopback so one may be attached to watch.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <spice.h>
+#include <spice/macros.h>
+
+#include "compositor-spice.h"
+#include "shared/config-parser.h"
+#include "weston_basic_event_loop.h"
+#include "weston_qxl_commands.h"
+
+#define SCROLL_STEP     16
+#define GLYPH_WIDTH     8
+#define GLYPH_HEIGHT    16
+#define DRAG_WIDTH      400
+#define DRAG_HEIGHT     300
+#define VIDEO_WIDTH     640
+#define VIDEO_HEIGHT    360
+
+/* Give up on a frame red_worker does not take in time */
+#define DRAIN_TIMEOUT   1000
+
+struct bench {
+    struct wl_display *wl_display;
+    struct wl_event_loop *loop;
+    struct weston_compositor compositor;
+    struct spice_backend backend;
+    struct spice_display display;
+
+    int width, height;
+    uint8_t *surface;
+    pixman_image_t *frame;
+    struct spice_snapshot *snapshots[NUM_SNAPSHOTS];
+    int next_snapshot;
+    uint32_t snapshot_allocs;
+
+    int drained;
+    uint32_t seed;
+    uint32_t histogram[RELEASE_HISTOGRAM_SIZE];
+
+    /* Pattern state */
+    int text_x, text_y;
+    pixman_image_t *window;
+    int window_x, window_y, window_dx, window_dy;
+};
+
+/* What a pattern did to the frame: damage to be sent as pixels and an
+ * optional move, as moves detection would find it.
+ */
+struct bench_step {
+    pixman_region32_t damage;
+    int copy;
+    pixman_box32_t copy_dest;
+    int copy_src_x, copy_src_y;
+    int video;
+    pixman_box32_t video_box;
+};
+
+struct bench_pattern {
+    const char *name;
+    void (*init) (struct bench *bench);
+    void (*step) (struct bench *bench, struct bench_step *step);
+};
+
+struct bench_stats {
+    uint32_t frames;
+    uint32_t timeouts;
+    uint64_t nsec;
+    uint64_t bytes;
+    uint64_t ring_sum;
+    uint32_t ring_peak;
+    uint32_t allocs;
+};
+
+static uint32_t
+bench_random (struct bench *bench)
+{
+    /* xorshift32 */
+    bench->seed ^= bench->seed << 13;
+    bench->seed ^= bench->seed >> 17;
+    bench->seed ^= bench->seed << 5;
+    return bench->seed;
+}
+
+/* Pixels which neither compress to nothing nor look uniform */
+static void
+bench_noise (struct bench *bench, pixman_image_t *image,
+        int x, int y, int width, int height)
+{
+    uint32_t *data = pixman_image_get_data (image);
+    int stride = pixman_image_get_stride (image) / 4;
+    int i, j;
+
+    for (j = y; j < y + height; ++j) {
+        for (i = x; i < x + width; ++i) {
+            data[j * stride + i] = bench_random (bench) | 0xff000000;
+        }
+    }
+}
+
+static void
+bench_fill (pixman_image_t *image, uint32_t argb,
+        int x, int y, int width, int height)
+{
+    pixman_color_t color = {
+        .red = (argb >> 8) & 0xff00,
+        .green = argb & 0xff00,
+        .blue = (argb << 8) & 0xff00,
+        .alpha = 0xffff,
+    };
+    pixman_box32_t box = { x, y, x + width, y + height };
+
+    pixman_image_fill_boxes (PIXMAN_OP_SRC, image, &color, 1, &box);
+}
+
+static void
+typing_init (struct bench *bench)
+{
+    bench_fill (bench->frame, 0xffffff, 0, 0, bench->width, bench->height);
+    bench->text_x = 0;
+    bench->text_y = 0;
+}
+
+/* One glyph per frame, line after line */
+static void
+typing_step (struct bench *bench, struct bench_step *step)
+{
+    if (bench->text_x + GLYPH_WIDTH > bench->width) {
+        bench->text_x = 0;
+        bench->text_y += GLYPH_HEIGHT;
+    }
+    if (bench->text_y + GLYPH_HEIGHT > bench->height) {
+        bench->text_y = 0;
+    }
+    bench_noise (bench, bench->frame, bench->text_x, bench->text_y,
+            GLYPH_WIDTH, GLYPH_HEIGHT);
+    pixman_region32_union_rect (&step->damage, &step->damage,
+            bench->text_x, bench->text_y, GLYPH_WIDTH, GLYPH_HEIGHT);
+    bench->text_x += GLYPH_WIDTH;
+}
+
+static void
+scrolling_init (struct bench *bench)
+{
+    bench_noise (bench, bench->frame, 0, 0, bench->width, bench->height);
+}
+
+/* Whole frame goes up, a new line of text comes at the bottom */
+static void
+scrolling_step (struct bench *bench, struct bench_step *step)
+{
+    uint8_t *data = (uint8_t *)pixman_image_get_data (bench->frame);
+    int stride = pixman_image_get_stride (bench->frame);
+    int height = bench->height - SCROLL_STEP;
+
+    memmove (data, data + SCROLL_STEP * stride, height * stride);
+    bench_fill (bench->frame, 0xffffff, 0, height,
+            bench->width, SCROLL_STEP);
+    bench_noise (bench, bench->frame, 0, height,
+            bench->width / 2, SCROLL_STEP);
+
+    step->copy = TRUE;
+    step->copy_dest = (pixman_box32_t) { 0, 0, bench->width, height };
+    step->copy_src_x = 0;
+    step->copy_src_y = SCROLL_STEP;
+    pixman_region32_union_rect (&step->damage, &step->damage,
+            0, height, bench->width, SCROLL_STEP);
+}
+
+static void
+drag_init (struct bench *bench)
+{
+    bench_fill (bench->frame, 0x336699, 0, 0, bench->width, bench->height);
+    if (bench->window == NULL) {
+        bench->window = pixman_image_create_bits (PIXMAN_a8r8g8b8,
+                DRAG_WIDTH, DRAG_HEIGHT, NULL, DRAG_WIDTH * 4);
+        bench_noise (bench, bench->window, 0, 0, DRAG_WIDTH, DRAG_HEIGHT);
+    }
+    bench->window_x = 0;
+    bench->window_y = 0;
+    bench->window_dx = 7;
+    bench->window_dy = 3;
+    pixman_image_composite32 (PIXMAN_OP_SRC, bench->window, NULL,
+            bench->frame, 0, 0, 0, 0, 0, 0, DRAG_WIDTH, DRAG_HEIGHT);
+}
+
+/* Window bounces around the desktop */
+static void
+drag_step (struct bench *bench, struct bench_step *step)
+{
+    int old_x = bench->window_x, old_y = bench->window_y;
+    pixman_region32_t exposed, window;
+
+    if (old_x + bench->window_dx < 0 ||
+            old_x + bench->window_dx + DRAG_WIDTH > bench->width)
+    {
+        bench->window_dx = -bench->window_dx;
+    }
+    if (old_y + bench->window_dy < 0 ||
+            old_y + bench->window_dy + DRAG_HEIGHT > bench->height)
+    {
+        bench->window_dy = -bench->window_dy;
+    }
+    bench->window_x += bench->window_dx;
+    bench->window_y += bench->window_dy;
+
+    bench_fill (bench->frame, 0x336699, old_x, old_y,
+            DRAG_WIDTH, DRAG_HEIGHT);
+    pixman_image_composite32 (PIXMAN_OP_SRC, bench->window, NULL,
+            bench->frame, 0, 0, 0, 0, bench->window_x, bench->window_y,
+            DRAG_WIDTH, DRAG_HEIGHT);
+
+    step->copy = TRUE;
+    step->copy_dest = (pixman_box32_t) {
+        bench->window_x, bench->window_y,
+        bench->window_x + DRAG_WIDTH, bench->window_y + DRAG_HEIGHT };
+    step->copy_src_x = old_x;
+    step->copy_src_y = old_y;
+
+    /* Only the uncovered part of the old position is new pixels */
+    pixman_region32_init_rect (&exposed, old_x, old_y,
+            DRAG_WIDTH, DRAG_HEIGHT);
+    pixman_region32_init_rect (&window, bench->window_x, bench->window_y,
+            DRAG_WIDTH, DRAG_HEIGHT);
+    pixman_region32_subtract (&exposed, &exposed, &window);
+    pixman_region32_union (&step->damage, &step->damage, &exposed);
+    pixman_region32_fini (&window);
+    pixman_region32_fini (&exposed);
+}
+
+static void
+video_init (struct bench *bench)
+{
+    bench_fill (bench->frame, 0x000000, 0, 0, bench->width, bench->height);
+}
+
+/* New content every frame at the same place */
+static void
+video_step (struct bench *bench, struct bench_step *step)
+{
+    int width = MIN (VIDEO_WIDTH, bench->width);
+    int height = MIN (VIDEO_HEIGHT, bench->height);
+    int x = (bench->width - width) / 2;
+    int y = (bench->height - height) / 2;
+
+    bench_noise (bench, bench->frame, x, y, width, height);
+    step->video = TRUE;
+    step->video_box = (pixman_box32_t) { x, y, x + width, y + height };
+    pixman_region32_union_rect (&step->damage, &step->damage,
+            x, y, width, height);
+}
+
+static const struct bench_pattern patterns[] = {
+    { "typing", typing_init, typing_step },
+    { "scrolling", scrolling_init, scrolling_step },
+    { "drag", drag_init, drag_step },
+    { "video", video_init, video_step },
+};
+
+static struct spice_snapshot *
+bench_get_snapshot (struct bench *bench)
+{
+    struct spice_snapshot **slot;
+    int i;
+
+    for (i = 0; i < NUM_SNAPSHOTS; ++i) {
+        slot = &bench->snapshots[(bench->next_snapshot + i) % NUM_SNAPSHOTS];
+        if (*slot == NULL) {
+            *slot = spice_snapshot_create (bench->width, bench->height);
+            bench->snapshot_allocs++;
+        }
+        if (*slot != NULL && !spice_snapshot_is_busy (*slot)) {
+            bench->next_snapshot =
+                (bench->next_snapshot + i + 1) % NUM_SNAPSHOTS;
+            return *slot;
+        }
+    }
+    return NULL;
+}
+
+static void
+bench_commands_drained (struct spice_display *display)
+{
+    struct bench *bench = wl_container_of(display, bench, display);
+
+    bench->drained = TRUE;
+}
+
+static void
+bench_wait_drain (struct bench *bench, struct bench_stats *stats)
+{
+    uint32_t start = spice_get_monotonic_msec ();
+    int elapsed;
+
+    bench->drained = FALSE;
+    if (bench->backend.request_drain (&bench->display)) {
+        return;
+    }
+    while (!bench->drained) {
+        elapsed = spice_get_monotonic_msec () - start;
+        if (elapsed >= DRAIN_TIMEOUT) {
+            stats->timeouts++;
+            return;
+        }
+        wl_event_loop_dispatch (bench->loop, DRAIN_TIMEOUT - elapsed);
+    }
+}
+
+/* Same order as spice_output_repaint: moves, snapshot, pixels */
+static void
+bench_frame (struct bench *bench, const struct bench_pattern *pattern,
+        struct bench_stats *stats)
+{
+    struct spice_display *display = &bench->display;
+    struct spice_snapshot *snapshot;
+    struct bench_step step = { 0 };
+    uint64_t start = spice_get_monotonic_nsec ();
+    uint64_t bytes = display->pushed_bytes;
+    uint32_t depth;
+
+    snapshot = bench_get_snapshot (bench);
+    if (snapshot == NULL) {
+        bench_wait_drain (bench, stats);
+        return;
+    }
+
+    pixman_region32_init (&step.damage);
+    pattern->step (bench, &step);
+    display->frame_mm_time = spice_get_mm_time (&bench->backend);
+
+    if (step.copy) {
+        spice_copy_bits (display, &step.copy_dest,
+                step.copy_src_x, step.copy_src_y);
+    }
+    spice_damage_reduce (&step.damage);
+    pixman_image_set_clip_region32 (snapshot->image, &step.damage);
+    pixman_image_composite32 (PIXMAN_OP_SRC, bench->frame, NULL,
+            snapshot->image, 0, 0, 0, 0, 0, 0, bench->width, bench->height);
+    pixman_image_set_clip_region32 (snapshot->image, NULL);
+    if (step.video) {
+        spice_paint_video (display, snapshot, &step.video_box);
+    } else {
+        spice_paint_image (display, 0, 0, bench->width, bench->height,
+                snapshot, &step.damage, NULL);
+    }
+    pixman_region32_fini (&step.damage);
+
+    depth = MAX_COMMAND_NUM - bench->backend.commands_free (display);
+    stats->ring_sum += depth;
+    if (depth > stats->ring_peak) {
+        stats->ring_peak = depth;
+    }
+    spice_qxl_wakeup (&display->display_sin);
+    bench_wait_drain (bench, stats);
+
+    stats->bytes += display->pushed_bytes - bytes;
+    stats->nsec += spice_get_monotonic_nsec () - start;
+    stats->frames++;
+}
+
+static uint32_t
+bench_percentile (const uint32_t *histogram, uint64_t total, int percent)
+{
+    uint64_t seen = 0;
+    uint32_t i;
+
+    for (i = 0; i < RELEASE_HISTOGRAM_SIZE; ++i) {
+        seen += histogram[i];
+        if (seen * 100 >= total * percent) {
+            return i;
+        }
+    }
+    return RELEASE_HISTOGRAM_SIZE - 1;
+}
+
+static uint32_t
+bench_pool_misses (struct bench *bench)
+{
+    return bench->backend.image_pool.misses +
+        bench->backend.drawable_pool.misses + bench->snapshot_allocs;
+}
+
+static void
+bench_run (struct bench *bench, const struct bench_pattern *pattern,
+        int frames)
+{
+    struct bench_stats stats = { 0 };
+    uint32_t allocs = bench_pool_misses (bench);
+    uint64_t releases = 0;
+    int i;
+
+    pattern->init (bench);
+    for (i = 0; i < RELEASE_HISTOGRAM_SIZE; ++i) {
+        __atomic_store_n (&bench->histogram[i], 0, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < frames; ++i) {
+        bench_frame (bench, pattern, &stats);
+    }
+    stats.allocs = bench_pool_misses (bench) - allocs;
+
+    for (i = 0; i < RELEASE_HISTOGRAM_SIZE; ++i) {
+        releases += __atomic_load_n (&bench->histogram[i], __ATOMIC_RELAXED);
+    }
+    printf ("%-10s %6u frames %8.1f fps %10.0f bytes/frame "
+            "ring avg %6.1f peak %4u  allocs %4u  "
+            "release p50 %3u ms p99 %3u ms  inflight %u KiB",
+            pattern->name, stats.frames,
+            stats.nsec ? stats.frames * 1e9 / stats.nsec : 0.0,
+            stats.frames ? (double)stats.bytes / stats.frames : 0.0,
+            stats.frames ? (double)stats.ring_sum / stats.frames : 0.0,
+            stats.ring_peak, stats.allocs,
+            bench_percentile (bench->histogram, releases, 50),
+            bench_percentile (bench->histogram, releases, 99),
+            (uint32_t)(__atomic_load_n (&bench->display.inflight_bytes,
+                    __ATOMIC_RELAXED) >> 10));
+    if (stats.timeouts > 0) {
+        printf ("  %u drain timeouts", stats.timeouts);
+    }
+    printf ("\n");
+    fflush (stdout);
+}
+
+static int
+bench_init (struct bench *bench, int port)
+{
+    struct spice_backend *b = &bench->backend;
+
+    bench->wl_display = wl_display_create ();
+    if (bench->wl_display == NULL) {
+        return -1;
+    }
+    bench->loop = wl_display_get_event_loop (bench->wl_display);
+    bench->compositor.wl_display = bench->wl_display;
+    bench->seed = 0x12345678;
+
+    b->compositor = &bench->compositor;
+    b->num_surfaces = NUM_SURFACES;
+    b->commands_drained = bench_commands_drained;
+    b->core = basic_event_loop_init (&bench->compositor, &b->core_source);
+    if (b->core == NULL) {
+        return -1;
+    }
+
+    b->spice_server = spice_server_new ();
+    spice_server_set_addr (b->spice_server, "127.0.0.1", 0);
+    spice_server_set_port (b->spice_server, port);
+    spice_server_set_noauth (b->spice_server);
+    spice_server_init (b->spice_server, b->core);
+    if (spice_qxl_commands_init (b) < 0) {
+        return -1;
+    }
+
+    bench->surface = calloc (bench->width * bench->height, 4);
+    bench->frame = pixman_image_create_bits (PIXMAN_a8r8g8b8,
+            bench->width, bench->height, NULL, bench->width * 4);
+    if (bench->surface == NULL || bench->frame == NULL) {
+        return -1;
+    }
+
+    bench->display.backend = b;
+    bench->display.release_histogram = bench->histogram;
+    if (spice_display_commands_init (&bench->display) < 0 ||
+            weston_spice_qxl_init (&bench->display) < 0)
+    {
+        return -1;
+    }
+    spice_create_primary_surface (&bench->display,
+            bench->width, bench->height, bench->surface);
+    spice_server_vm_start (b->spice_server);
+    b->vm_running = TRUE;
+    return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    static struct bench bench;
+    char *only = NULL;
+    int frames = 600, soak = 0, port = 5930;
+    uint32_t start, round = 0;
+    unsigned i;
+
+    const struct weston_option options[] = {
+        { WESTON_OPTION_INTEGER, "width", 0, &bench.width },
+        { WESTON_OPTION_INTEGER, "height", 0, &bench.height },
+        { WESTON_OPTION_INTEGER, "frames", 0, &frames },
+        { WESTON_OPTION_INTEGER, "soak", 0, &soak },
+        { WESTON_OPTION_INTEGER, "port", 0, &port },
+        { WESTON_OPTION_STRING, "pattern", 0, &only },
+    };
+
+    bench.width = DEFAULT_WIDTH;
+    bench.height = DEFAULT_HEIGHT;
+    parse_options (options, ARRAY_LENGTH (options), &argc, argv);
+    if (argc > 1 || bench.width < DRAG_WIDTH || bench.height < DRAG_HEIGHT ||
+            frames <= 0 || soak < 0)
+    {
+        fprintf (stderr, "Usage: %s [--width=W] [--height=H] "
+                "[--frames=N] [--soak=SECONDS] [--port=PORT]\n"
+                "\t[--pattern=typing|scrolling|drag|video]\n"
+                "Size must be at least %dx%d\n",
+                argv[0], DRAG_WIDTH, DRAG_HEIGHT);
+        return 1;
+    }
+
+    weston_log_file_open (NULL);
+    if (bench_init (&bench, port) < 0) {
+        fprintf (stderr, "Failed to start spice server\n");
+        return 1;
+    }
+    printf ("spice-bench %dx%d, %d frames per pattern, "
+            "spice://127.0.0.1:%d\n", bench.width, bench.height,
+            frames, port);
+
+    /* Soak repeats all patterns, inflight and allocs must stay flat */
+    start = spice_get_monotonic_msec ();
+    do {
+        if (soak > 0) {
+            printf ("round %u\n", ++round);
+        }
+        for (i = 0; i < ARRAY_LENGTH (patterns); ++i) {
+            if (only == NULL || strcmp (only, patterns[i].name) == 0) {
+                bench_run (&bench, &patterns[i], frames);
+            }
+        }
+    } while (spice_get_monotonic_msec () - start < (uint32_t)soak * 1000);
+
+    spice_server_vm_stop (bench.backend.spice_server);
+    weston_spice_qxl_destroy (&bench.display);
+    spice_display_commands_destroy (&bench.display);
+    spice_qxl_commands_destroy (&bench.backend);
+    basic_event_loop_destroy (bench.backend.core, bench.backend.core_source);
+    weston_log_file_close ();
+    return 0;
+}
@@ -33,8 +33,16 @@
 #include "weston_basic_event_loop.h"
 #include "compositor-spice.h"
 
-static SpiceCoreInterface core;
-static struct wl_event_loop *loop = NULL;
+/* SpiceCoreInterface callbacks carry no instance pointer, so there is
+ * one core per process. Its timers and watches live on a private event
+ * loop, whose fd every spice backend adds to its compositor's loop, so
+ * backends may run on different loops of the same thread.
+ */
+static struct {
+    SpiceCoreInterface core;
+    struct wl_event_loop *loop;
+    int refcount;
+} shared;
 
 typedef struct SpiceTimer {
     struct wl_event_source *event_source;
@@ -61,7 +69,7 @@ timer_add(SpiceTimerFunc func, void *opaque)
 {
     SpiceTimer *timer;
 
-    assert (loop != NULL);
+    assert (shared.loop != NULL);
 
     timer = calloc(sizeof(SpiceTimer), 1);
 
@@ -71,7 +79,7 @@ timer_add(SpiceTimerFunc func, void *opaque)
 
     timer->func = func;
     timer->opaque = opaque;
-    timer->event_source = wl_event_loop_add_timer (loop,
+    timer->event_source = wl_event_loop_add_timer (shared.loop,
         exec_timer, timer );
     if (timer->event_source == NULL) {
         goto err_add;
@@ -116,14 +124,14 @@ watch_add (int fd, int event_mask, SpiceWatchFunc func, void *opaque)
 {
     SpiceWatch *watch;
 
-    assert (loop != NULL);
+    assert (shared.loop != NULL);
     watch = calloc (sizeof *watch, 1);
     if (watch == NULL) {
         return NULL;
     }
 
     watch->event_source =  wl_event_loop_add_fd (
-        loop, fd, event_mask, exec_watch, watch );
+        shared.loop, fd, event_mask, exec_watch, watch );
     watch->func = func;
     watch->opaque = opaque;
 
@@ -146,20 +154,70 @@ channel_event (int event, SpiceChannelEventInfo *info)
 {
 }
 
+static int
+dispatch_shared (int fd, uint32_t mask, void *data)
+{
+    wl_event_loop_dispatch (shared.loop, 0);
+    return 1;
+}
+
+static int
+shared_init (void)
+{
+    shared.loop = wl_event_loop_create ();
+    if (shared.loop == NULL) {
+        return -1;
+    }
+    memset(&shared.core, 0, sizeof(shared.core));
+    shared.core.base.major_version = SPICE_INTERFACE_CORE_MAJOR;
+    shared.core.base.minor_version = SPICE_INTERFACE_CORE_MINOR; // anything less then 3 and channel_event isn't called
+    shared.core.timer_add = timer_add;
+    shared.core.timer_start = timer_start;
+    shared.core.timer_cancel = timer_cancel;
+    shared.core.timer_remove = timer_remove;
+    shared.core.watch_add = watch_add;
+    shared.core.watch_update_mask = watch_update_mask;
+    shared.core.watch_remove = watch_remove;
+    shared.core.channel_event = channel_event;
+    return 0;
+}
+
+/* Takes a reference on the core, source is where the compositor's loop
+ * dispatches it and has to be passed back to basic_event_loop_destroy.
+ */
 SpiceCoreInterface *
-basic_event_loop_init(struct weston_compositor *compositor)
+basic_event_loop_init(struct weston_compositor *compositor,
+        struct wl_event_source **source)
 {
-    loop = wl_display_get_event_loop (compositor->wl_display);
-    memset(&core, 0, sizeof(core));
-    core.base.major_version = SPICE_INTERFACE_CORE_MAJOR;
-    core.base.minor_version = SPICE_INTERFACE_CORE_MINOR; // anything less then 3 and channel_event isn't called
-    core.timer_add = timer_add;
-    core.timer_start = timer_start;
-    core.timer_cancel = timer_cancel;
-    core.timer_remove = timer_remove;
-    core.watch_add = watch_add;
-    core.watch_update_mask = watch_update_mask;
-    core.watch_remove = watch_remove;
-    core.channel_event = channel_event;
-    return &core;
+    struct wl_event_loop *loop =
+        wl_display_get_event_loop (compositor->wl_display);
+
+    if (shared.refcount == 0 && shared_init () < 0) {
+        weston_log("Failed to create spice event loop\n");
+        return NULL;
+    }
+    *source = wl_event_loop_add_fd (loop, wl_event_loop_get_fd (shared.loop),
+            WL_EVENT_READABLE, dispatch_shared, NULL);
+    if (*source == NULL) {
+        if (shared.refcount == 0) {
+            wl_event_loop_destroy (shared.loop);
+            shared.loop = NULL;
+        }
+        return NULL;
+    }
+    shared.refcount++;
+    return &shared.core;
+}
+
+void
+basic_event_loop_destroy(SpiceCoreInterface *core,
+        struct wl_event_source *source)
+{
+    assert (core == &shared.core && shared.refcount > 0);
+
+    wl_event_source_remove (source);
+    if (--shared.refcount == 0) {
+        wl_event_loop_destroy (shared.loop);
+        shared.loop = NULL;
+    }
 }
@@ -26,6 +26,9 @@
 #include <spice.h>
 #include "compositor.h"
 
-SpiceCoreInterface *basic_event_loop_init(struct weston_compositor *compositor);
+SpiceCoreInterface *basic_event_loop_init(struct weston_compositor *compositor,
+        struct wl_event_source **source);
+void basic_event_loop_destroy(SpiceCoreInterface *core,
+        struct wl_event_source *source);
 
 #endif // __BASIC_EVENT_LOOP_H__
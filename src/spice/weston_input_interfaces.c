@@ -23,6 +23,8 @@
 #include <linux/input.h>
 #include <stdlib.h>
 
+#include <spice/macros.h>
+
 #include "compositor-spice.h"
 #include "weston_spice_interfaces.h"
 
@@ -36,13 +38,24 @@
 
 #define DEFAULT_AXIS_STEP_DISTANCE wl_fixed_from_int(10)
 
-/* TODO ledstate getting
- * TODO free mouse and kbd interfaces
- */
+/* Kinds of motion waiting for the frame */
+#define MOTION_REL (1 << 0)
+#define MOTION_ABS (1 << 1)
+
 struct weston_spice_mouse {
     SpiceMouseInstance sin;
+    SpiceTabletInstance tablet;
     uint32_t buttons_state;
     struct spice_backend *b;
+
+    /* Area the tablet positions are given in */
+    int logical_width;
+    int logical_height;
+
+    /* Motion accumulated since it was last delivered */
+    uint32_t pending;
+    int dx, dy;
+    int x, y;
 };
 
 struct weston_spice_kbd {
@@ -75,30 +88,112 @@ weston_mouse_button_notify (struct spice_backend *b,
     mouse->buttons_state = buttons_state;
 }
 
-static void
-weston_mouse_motion (SpiceMouseInstance *sin, int dx, int dy, int dz,
-        uint32_t buttons_state)
+/* Delivers motion accumulated so far as a single event. Called by
+ * outputs when their frame is done, and before anything which must
+ * not overtake the motion.
+ */
+void
+weston_spice_mouse_flush (spice_backend_t *b)
 {
-    struct weston_spice_mouse *mouse = wl_container_of(sin, mouse, sin);
-    struct spice_backend *b = mouse->b;
+    struct weston_spice_mouse *mouse = b->mouse;
+    struct weston_output *output;
     struct weston_pointer_motion_event motion_ev = {
-        WESTON_POINTER_MOTION_REL,0,0,
-        /* TODO is it necessary? */
-        wl_fixed_to_double(wl_fixed_from_int(dx)),
-        wl_fixed_to_double(wl_fixed_from_int(dy)),
+        .mask = WESTON_POINTER_MOTION_REL,
     };
+    double x, y;
+    uint32_t time;
+
+    if (mouse == NULL || mouse->pending == 0) {
+        return;
+    }
+    time = weston_compositor_get_time();
+
+    if (mouse->pending & MOTION_REL) {
+        motion_ev.dx = mouse->dx;
+        motion_ev.dy = mouse->dy;
+        notify_motion (&b->core_seat, time, &motion_ev);
+    }
+    /* Tablet is used with a single display only, see
+     * spice_create_outputs
+     */
+    if (mouse->pending & MOTION_ABS &&
+            !wl_list_empty (&b->compositor->output_list))
+    {
+        output = wl_container_of(b->compositor->output_list.next,
+                output, link);
+        x = mouse->x;
+        y = mouse->y;
+        if (mouse->logical_width > 0 && mouse->logical_height > 0) {
+            x = x * output->width / mouse->logical_width;
+            y = y * output->height / mouse->logical_height;
+        }
+        notify_motion_absolute (&b->core_seat, time,
+                wl_fixed_from_double (output->x + x),
+                wl_fixed_from_double (output->y + y));
+    }
+
+    mouse->pending = 0;
+    mouse->dx = mouse->dy = 0;
+}
+
+static int
+weston_spice_repaint_scheduled (struct spice_backend *b)
+{
+    struct weston_output *output;
+
+    wl_list_for_each(output, &b->compositor->output_list, link) {
+        if (output->repaint_scheduled) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Clients send motion much more often than frames are shown. While a
+ * frame is in progress motion is only accumulated, it is delivered
+ * when the frame is done. Idle compositor gets it at once.
+ */
+static void
+weston_mouse_queue_motion (struct weston_spice_mouse *mouse, uint32_t kind)
+{
+    mouse->pending |= kind;
+    if (!weston_spice_repaint_scheduled (mouse->b)) {
+        weston_spice_mouse_flush (mouse->b);
+    }
+}
+
+static void
+weston_mouse_wheel (struct weston_spice_mouse *mouse, int dz)
+{
     struct weston_pointer_axis_event axis_ev = {
         WL_POINTER_AXIS_VERTICAL_SCROLL,
         wl_fixed_from_int(dz),
         0, 0
     };
-    notify_motion(&b->core_seat, weston_compositor_get_time(), &motion_ev);
 
-    if (dz) {
-        notify_axis (&b->core_seat, weston_compositor_get_time(),
-                     &axis_ev);
+    notify_axis (&mouse->b->core_seat, weston_compositor_get_time(),
+                 &axis_ev);
+}
+
+static void
+weston_mouse_motion (SpiceMouseInstance *sin, int dx, int dy, int dz,
+        uint32_t buttons_state)
+{
+    struct weston_spice_mouse *mouse = wl_container_of(sin, mouse, sin);
+    struct spice_backend *b = mouse->b;
+
+    mouse->dx += dx;
+    mouse->dy += dy;
+    if (dz || buttons_state != mouse->buttons_state) {
+        mouse->pending |= MOTION_REL;
+        weston_spice_mouse_flush (b);
+        if (dz) {
+            weston_mouse_wheel (mouse, dz);
+        }
+        weston_mouse_button_notify (b, mouse, buttons_state);
+        return;
     }
-    weston_mouse_button_notify (b, mouse, buttons_state);
+    weston_mouse_queue_motion (mouse, MOTION_REL);
 }
 static void
 weston_mouse_buttons (SpiceMouseInstance *sin, uint32_t buttons_state )
@@ -109,6 +204,7 @@ weston_mouse_buttons (SpiceMouseInstance *sin, uint32_t buttons_state )
     /*if (!b->core_seat.has_pointer) {
         return;
     }*/
+    weston_spice_mouse_flush (b);
     weston_mouse_button_notify (b, mouse, buttons_state);
 }
 
@@ -122,30 +218,95 @@ static struct SpiceMouseInterface weston_mouse_interface = {
     .buttons    = weston_mouse_buttons,
 };
 
-void
+static void
+weston_tablet_set_logical_size (SpiceTabletInstance *sin,
+        int width, int height)
+{
+    struct weston_spice_mouse *mouse = wl_container_of(sin, mouse, tablet);
+
+    mouse->logical_width = width;
+    mouse->logical_height = height;
+}
+static void
+weston_tablet_position (SpiceTabletInstance *sin, int x, int y,
+        uint32_t buttons_state)
+{
+    struct weston_spice_mouse *mouse = wl_container_of(sin, mouse, tablet);
+
+    mouse->x = x;
+    mouse->y = y;
+    if (buttons_state != mouse->buttons_state) {
+        mouse->pending |= MOTION_ABS;
+        weston_spice_mouse_flush (mouse->b);
+        weston_mouse_button_notify (mouse->b, mouse, buttons_state);
+        return;
+    }
+    weston_mouse_queue_motion (mouse, MOTION_ABS);
+}
+static void
+weston_tablet_wheel (SpiceTabletInstance *sin, int wheel_motion,
+        uint32_t buttons_state)
+{
+    struct weston_spice_mouse *mouse = wl_container_of(sin, mouse, tablet);
+
+    weston_spice_mouse_flush (mouse->b);
+    weston_mouse_wheel (mouse, wheel_motion);
+    weston_mouse_button_notify (mouse->b, mouse, buttons_state);
+}
+static void
+weston_tablet_buttons (SpiceTabletInstance *sin, uint32_t buttons_state)
+{
+    struct weston_spice_mouse *mouse = wl_container_of(sin, mouse, tablet);
+
+    weston_spice_mouse_flush (mouse->b);
+    weston_mouse_button_notify (mouse->b, mouse, buttons_state);
+}
+
+/* Used by spice in client mouse mode, positions are absolute */
+static struct SpiceTabletInterface weston_tablet_interface = {
+    .base.type          = SPICE_INTERFACE_TABLET,
+    .base.description   = "weston tablet",
+    .base.major_version = SPICE_INTERFACE_TABLET_MAJOR,
+    .base.minor_version = SPICE_INTERFACE_TABLET_MINOR,
+
+    .set_logical_size   = weston_tablet_set_logical_size,
+    .position           = weston_tablet_position,
+    .wheel              = weston_tablet_wheel,
+    .buttons            = weston_tablet_buttons,
+};
+
+int
 weston_spice_mouse_init (spice_backend_t *b)
 {
-    static int mouse_count = 0;
     struct weston_spice_mouse *mouse;
 
-    if ( ++mouse_count > 1 ) {
-        weston_log("Only one instance of mouse interface is supported");
-        exit(1);
+    /* One mouse per backend, every backend has its own server */
+    if (b->mouse != NULL) {
+        weston_log("Mouse interface is already added\n");
+        return -1;
     }
 
     mouse = calloc (1, sizeof *mouse);
+    if (mouse == NULL) {
+        return -1;
+    }
     mouse->sin.base.sif     = &weston_mouse_interface.base;
+    mouse->tablet.base.sif  = &weston_tablet_interface.base;
     mouse->buttons_state    = 0;
     mouse->b                = b;
 
     weston_seat_init_pointer (&b->core_seat);
     spice_server_add_interface (b->spice_server, &mouse->sin.base);
+    spice_server_add_interface (b->spice_server, &mouse->tablet.base);
     b->mouse = mouse;
+
+    return 0;
 }
 void
 weston_spice_mouse_destroy (spice_backend_t *b)
 {
     free (b->mouse);
+    b->mouse = NULL;
 }
 
 //from xf86-video-qxl/src/spiceqxl_inputs.b
@@ -176,16 +337,18 @@ static uint8_t escaped_map[256] = {
 # define MIN_KEYCODE 0;
 #endif //MIN_KEYCODE
 
+/* Keys are delivered as soon as they are decoded. Held back like
+ * motion they would still need a modifier update each, as clients take
+ * the modifiers in effect from the last update before a key.
+ */
 static void
 weston_kbd_push_scan_frag (SpiceKbdInstance *sin, uint8_t frag)
 {
     struct weston_spice_kbd *kbd = wl_container_of(sin, kbd, sin);
     struct spice_backend *b = kbd->b;
     enum wl_keyboard_key_state state;
+    uint32_t key;
 
-    /*if (!b->core_seat.has_pointer) {
-        return;
-    }*/
     if (frag == 224) {
         kbd->escape = frag;
         return;
@@ -195,26 +358,60 @@ weston_kbd_push_scan_frag (SpiceKbdInstance *sin, uint8_t frag)
     frag = frag & 0x7f;
     if (kbd->escape == 224) {
         kbd->escape = 0;
+        /* Fake shifts and codes nothing is known about */
         if (escaped_map[frag] == 0) {
+            return;
         }
-        frag = escaped_map[frag] - 8;
+        key = escaped_map[frag] - 8;
     } else {
-        frag += MIN_KEYCODE;
+        key = frag + MIN_KEYCODE;
     }
 
-    notify_key (&b->core_seat, weston_compositor_get_time(), frag,
-                    state, STATE_UPDATE_AUTOMATIC );
+    /* Motion goes first, it came before the key */
+    weston_spice_mouse_flush (b);
+    notify_key (&b->core_seat, weston_compositor_get_time(), key,
+            state, STATE_UPDATE_AUTOMATIC);
+}
+
+static uint8_t
+weston_kbd_spice_leds (enum weston_led leds)
+{
+    uint8_t spice_leds = 0;
+
+    if (leds & LED_SCROLL_LOCK) {
+        spice_leds |= SPICE_KEYBOARD_MODIFIER_FLAGS_SCROLL_LOCK;
+    }
+    if (leds & LED_NUM_LOCK) {
+        spice_leds |= SPICE_KEYBOARD_MODIFIER_FLAGS_NUM_LOCK;
+    }
+    if (leds & LED_CAPS_LOCK) {
+        spice_leds |= SPICE_KEYBOARD_MODIFIER_FLAGS_CAPS_LOCK;
+    }
+    return spice_leds;
+}
+
+/* Called by notify_modifiers when xkb state lights another set of
+ * LEDs, clients are told about it.
+ */
+static void
+weston_kbd_led_update (struct weston_seat *seat, enum weston_led leds)
+{
+    struct spice_backend *b = wl_container_of(seat, b, core_seat);
+    struct weston_spice_kbd *kbd = b->kbd;
+
+    if (kbd == NULL) {
+        return;
+    }
+    kbd->ledstate = weston_kbd_spice_leds (leds);
+    spice_server_kbd_leds (&kbd->sin, kbd->ledstate);
 }
+
 static uint8_t
 weston_kbd_get_leds (SpiceKbdInstance *sin)
 {
-#if 0
     struct weston_spice_kbd *kbd = wl_container_of(sin, kbd, sin);
-    struct spice_backend *b = kbd->b;
 
-    //TODO implement
-#endif
-    return 0;
+    return kbd->ledstate;
 }
 static struct SpiceKbdInterface weston_kbd_interface = {
     .base.type          = SPICE_INTERFACE_KEYBOARD,
@@ -228,29 +425,41 @@ static struct SpiceKbdInterface weston_kbd_interface = {
 int
 weston_spice_kbd_init (spice_backend_t *b)
 {
-    static int kbd_count = 0;
     struct weston_spice_kbd *kbd;
 
-    if ( ++kbd_count > 1 ) {
-        weston_log("Only one instance of kbd interface is suported");
-        exit(1);
+    if (b->kbd != NULL) {
+        weston_log("Keyboard interface is already added\n");
+        return -1;
     }
 
     kbd = calloc (1, sizeof *kbd);
+    if (kbd == NULL) {
+        return -1;
+    }
     kbd->sin.base.sif = &weston_kbd_interface.base;
     kbd->sin.st       = (SpiceKbdState*) kbd;
     kbd->b            = b;
     if(weston_seat_init_keyboard (&b->core_seat, NULL) < 0 ) {
         weston_log ("Failed to init seat keyboard");
+        free (kbd);
         return -1;
     }
     spice_server_add_interface (b->spice_server, &kbd->sin.base);
     b->kbd = kbd;
 
+    /* Keep client LEDs with xkb state, from the initial one on */
+    b->core_seat.led_update = weston_kbd_led_update;
+    if (b->compositor->use_xkbcommon) {
+        kbd->ledstate = weston_kbd_spice_leds (
+                weston_seat_get_keyboard (&b->core_seat)->xkb_state.leds);
+    }
+
     return 0;
 }
 void
 weston_spice_kbd_destroy (spice_backend_t *b)
 {
+    b->core_seat.led_update = NULL;
     free (b->kbd);
+    b->kbd = NULL;
 }
@@ -22,40 +22,131 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 
 #include <spice/qxl_dev.h>
 #include <spice.h>
 #include <spice/macros.h>
 
 #include "weston_qxl_commands.h"
+#include "weston_qxl_moves.h"
 #include "compositor-spice.h"
 #include "weston_spice_interfaces.h"
 
-//TODO implement
-typedef pixman_region32_t ClipList;
-
-struct surface_create_cmd {
+/* Offscreen surface create or destroy. Memory of the surface is given
+ * to the destroy command and freed on its release.
+ */
+struct surface_cmd {
     struct spice_release_info base;
     QXLCommandExt ext;
     QXLSurfaceCmd cmd;
+    uint8_t *data;
 };
 struct create_image_cmd {
     struct spice_release_info base;
     QXLCommandExt ext;
     QXLDrawable drawable;
     QXLImage image;
+    struct spice_snapshot *snapshot;
+};
+/* Recently sent bitmaps, indexed by content hash. Each distinct content
+ * gets its own image id, so the same pixels sent again become a
+ * reference into spice's client-side image cache.
+ */
+#define IMAGE_CACHE_SIZE 4096
+
+/* Bitmaps this small are mostly decorations, icons and the like, they
+ * are worth caching from the first time they are seen.
+ */
+#define IMAGE_CACHE_SMALL_AREA (64 * 64)
+
+struct image_cache_entry {
+    uint64_t hash;
+    uint32_t id;
+    int cached;
+};
+
+struct spice_image_cache {
+    struct image_cache_entry entries[IMAGE_CACHE_SIZE];
+    uint32_t last_id;
+
+    uint32_t lookups;
+    uint32_t hits;
+    uint32_t cached;
 };
-struct fill_cmd {
+
+/* Drawables which carry no bitmap */
+struct drawable_cmd {
     struct spice_release_info base;
     QXLCommandExt ext;
     QXLDrawable drawable;
 };
 
+/* Cursor move and hide, pooled per display */
+struct cursor_cmd {
+    struct spice_release_info base;
+    QXLCommandExt ext;
+    QXLCursorCmd cmd;
+};
+/* Cursor set carries its shape, pixels follow the struct */
+struct cursor_set_cmd {
+    struct spice_release_info base;
+    QXLCommandExt ext;
+    QXLCursorCmd cmd;
+    QXLCursor cursor;
+};
+
 void release_simple (struct spice_release_info *base)
 {
     free (base);
 }
 
+struct spice_snapshot *
+spice_snapshot_create (int width, int height)
+{
+    struct spice_snapshot *snapshot;
+
+    snapshot = zalloc (sizeof *snapshot);
+    if (snapshot == NULL) {
+        return NULL;
+    }
+    snapshot->image = pixman_image_create_bits (PIXMAN_a8r8g8b8,
+            width, height, NULL, width * 4);
+    if (snapshot->image == NULL) {
+        free (snapshot);
+        return NULL;
+    }
+    snapshot->refs = 1;
+    return snapshot;
+}
+
+void
+spice_snapshot_ref (struct spice_snapshot *snapshot)
+{
+    __atomic_add_fetch (&snapshot->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* May be called from red_worker thread */
+void
+spice_snapshot_unref (struct spice_snapshot *snapshot)
+{
+    if (__atomic_sub_fetch (&snapshot->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pixman_image_unref (snapshot->image);
+        free (snapshot);
+    }
+}
+
+static void
+release_image (struct spice_release_info *base)
+{
+    struct create_image_cmd *cmd = (struct create_image_cmd *)base;
+
+    if (cmd->snapshot != NULL) {
+        spice_snapshot_unref (cmd->snapshot);
+    }
+    spice_pool_put (base);
+}
+
 static void set_cmd(QXLCommandExt *ext, uint32_t type, QXLPHYSICAL data)
 {
     ext->cmd.type = type;
@@ -71,15 +162,13 @@ static void set_release_info(QXLReleaseInfo *info, intptr_t ptr)
 }
 
 
-static int surfaces_count = 0;
-uint32_t
-spice_create_primary_surface (struct spice_backend *b,
+void
+spice_create_primary_surface (struct spice_display *display,
         int width, int height, uint8_t *data)
 {
     QXLDevSurfaceCreate surface;
 
-    assert (surfaces_count < NUM_SURFACES );
-    assert (b->worker != NULL);
+    assert (display->worker != NULL);
     assert (width > 0);
     assert (height > 0);
 
@@ -87,123 +176,308 @@ spice_create_primary_surface (struct spice_backend *b,
     surface.width      = width;
     surface.height     = height;
     surface.stride     = -width * 4;
-    surface.mouse_mode = FALSE; /* unused by red_worker */
+    surface.mouse_mode = display->backend->client_mouse;
     surface.flags      = 0;
     surface.type       = 0;    /* unused by red_worker */
     surface.position   = 0;    /* unused by red_worker */
     surface.mem        = (uint64_t)data;
     surface.group_id   = MEMSLOT_GROUP;
 
-    spice_qxl_create_primary_surface(&b->display_sin, surfaces_count, &surface);
+    spice_qxl_create_primary_surface(&display->display_sin,
+            PRIMARY_SURFACE_ID, &surface);
+}
 
-    return surfaces_count++;
+/* Replaces primary surface with one of new size. red_worker flushes
+ * pending commands before the old surface is destroyed.
+ */
+void
+spice_reset_primary_surface (struct spice_display *display,
+        int width, int height, uint8_t *data)
+{
+    spice_qxl_destroy_primary_surface(&display->display_sin,
+            PRIMARY_SURFACE_ID);
+    spice_create_primary_surface (display, width, height, data);
 }
 static void
-fill_clip_data (QXLDrawable *drawable, ClipList *clip_rects)
+fill_clip_data (QXLDrawable *drawable)
 {
-    if (clip_rects == NULL /*|| clip_rects->num_rects == 0*/) {
-        drawable->clip.type = SPICE_CLIP_TYPE_NONE;
-    } /*else {
-        QXLClipRects *cmd_clip;
-
-        cmd_clip = calloc (sizeof(QXLClipRects) +
-            clip_rects->num_rects * sizeof(QXLRect), 1);
-        cmd_clip->num_rects = clip_rects->num_rects;
-        cmd_clip->chunk.data_size = clip_rects->num_rects*sizeof(QXLRect);
-        cmd_clip->chunk.prev_chunk = cmd_clip->chunk.next_chunk = 0;
-        memcpy(cmd_clip + 1, clip_rects->ptr, cmd_clip->chunk.data_size);
-
-        drawable->clip.type = SPICE_CLIP_TYPE_RECTS;
-        drawable->clip.data = (intptr_t)cmd_clip;
-
-        if (clip_rects->destroyable) {
-            free(clip_rects->ptr);
-        }
-    }*/
-
-   //TODO implement
+    /* Every drawable covers exactly one damaged box, so nothing to clip */
+    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    drawable->clip.data = 0;
 }
-static int
-make_drawable (const QXLRect *bbox, uint32_t surface_id,
-        ClipList *clip_rects, intptr_t release_info,
-        intptr_t image, QXLDrawable *drawable, uint32_t mm_time)
+static void
+init_drawable (QXLDrawable *drawable, uint8_t type, const QXLRect *bbox,
+        uint32_t surface_id, intptr_t release_info, uint32_t mm_time)
 {
-    /*
-    uint32_t bw = bbox->right - bbox->left;
-    uint32_t bh = bbox->bottom - bbox->top;
-    */
     drawable->surface_id = surface_id;
     drawable->bbox = *bbox;
-    //FIXME: Next line is forced nail.
-    drawable->mm_time = mm_time - 350;
+    drawable->mm_time = mm_time;
 
-    fill_clip_data (drawable, clip_rects);
+    fill_clip_data (drawable);
 
     drawable->effect            = QXL_EFFECT_OPAQUE;
     set_release_info (&drawable->release_info, release_info);
-    drawable->type              = QXL_DRAW_COPY;
+    drawable->type              = type;
     drawable->surfaces_dest[0]  = -1;
     drawable->surfaces_dest[1]  = -1;
     drawable->surfaces_dest[2]  = -1;
+}
+static int
+make_drawable (const QXLRect *bbox, uint32_t surface_id,
+        intptr_t release_info, intptr_t image,
+        QXLDrawable *drawable, uint32_t mm_time)
+{
+    init_drawable (drawable, QXL_DRAW_COPY, bbox, surface_id,
+            release_info, mm_time);
 
+    /* Bitmap covers only the bbox, so source area is the whole bitmap */
     drawable->u.copy.rop_descriptor     = SPICE_ROPD_OP_PUT;
     drawable->u.copy.src_bitmap         = (intptr_t)image;
-    drawable->u.copy.src_area.top       = clip_rects->extents.y1;
-    drawable->u.copy.src_area.left      = clip_rects->extents.x1;
-    drawable->u.copy.src_area.right     = clip_rects->extents.x2;
-    drawable->u.copy.src_area.bottom    = clip_rects->extents.y2;
+    drawable->u.copy.src_area.top       = 0;
+    drawable->u.copy.src_area.left      = 0;
+    drawable->u.copy.src_area.right     = bbox->right - bbox->left;
+    drawable->u.copy.src_area.bottom    = bbox->bottom - bbox->top;
 
     return 0;
 }
 
-static uint32_t image_counter = 0;
+int
+spice_qxl_commands_init (struct spice_backend *b)
+{
+    b->image_cache = zalloc (sizeof *b->image_cache);
+    if (b->image_cache == NULL) {
+        goto err_image_cache;
+    }
+    if (spice_pool_init (&b->image_pool, "image",
+                sizeof (struct create_image_cmd), IMAGE_POOL_SIZE) < 0)
+    {
+        goto err_image_pool;
+    }
+    if (spice_pool_init (&b->drawable_pool, "drawable",
+                sizeof (struct drawable_cmd), DRAWABLE_POOL_SIZE) < 0)
+    {
+        goto err_drawable_pool;
+    }
+    return 0;
+
+err_drawable_pool:
+    spice_pool_destroy (&b->image_pool);
+err_image_pool:
+    free (b->image_cache);
+    b->image_cache = NULL;
+err_image_cache:
+    return -1;
+}
+
+void
+spice_qxl_commands_destroy (struct spice_backend *b)
+{
+    struct spice_image_cache *cache = b->image_cache;
+
+    spice_pool_destroy (&b->drawable_pool);
+    spice_pool_destroy (&b->image_pool);
+
+    if (cache != NULL) {
+        weston_log ("Spice image cache: %u bitmaps, %u seen before, "
+                "%u sent as cache references\n",
+                cache->lookups, cache->hits, cache->cached);
+        free (cache);
+        b->image_cache = NULL;
+    }
+}
+
+int
+spice_display_commands_init (struct spice_display *display)
+{
+    return spice_pool_init (&display->cursor_pool, "cursor",
+            sizeof (struct cursor_cmd), CURSOR_POOL_SIZE);
+}
+
+void
+spice_display_commands_destroy (struct spice_display *display)
+{
+    spice_pool_destroy (&display->cursor_pool);
+}
 
 uint32_t
 spice_create_image (struct spice_backend *b)
 {
-    uint32_t image_id;
+    return ++b->image_cache->last_id;
+}
 
-    image_id = ++image_counter;
-    return image_id;
+/* FNV-1a over hashes of the rows, the ones computed by scroll
+ * detection are passed in rows, NULL to hash the pixels.
+ */
+static uint64_t
+hash_box (const uint8_t *data, int32_t stride, int width, int height,
+        const uint64_t *rows)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t row;
+    int y;
+
+    hash = (hash ^ (((uint64_t)width << 32) | height)) * 0x100000001b3ULL;
+    for (y = 0; y < height; ++y) {
+        row = rows != NULL ? rows[y] :
+            spice_hash_row ((const uint32_t *)(data + y * stride), width);
+        hash = (hash ^ row) * 0x100000001b3ULL;
+    }
+    return hash;
 }
 
-int
-spice_paint_image (struct spice_backend *b, uint32_t image_id,
-        int x, int y, int width, int height,
-        intptr_t data, int32_t stride, pixman_region32_t *damage )
+/* Chooses image id and caching flags for the bitmap. Content seen
+ * before keeps its id and is always cached, so it goes to the client as
+ * a cache reference from now on. New content is cached only if it is
+ * small enough to be likely reused.
+ */
+static void
+set_image_id (struct spice_backend *b, QXLImage *image,
+        const uint8_t *data, int32_t stride, int width, int height,
+        const uint64_t *rows)
+{
+    struct spice_image_cache *cache = b->image_cache;
+    struct image_cache_entry *entry;
+    uint64_t hash = hash_box (data, stride, width, height, rows);
+
+    ++cache->lookups;
+    entry = &cache->entries[hash % IMAGE_CACHE_SIZE];
+    if (entry->id != 0 && entry->hash == hash) {
+        ++cache->hits;
+        if (entry->cached) {
+            ++cache->cached;
+        }
+        entry->cached = TRUE;
+    } else {
+        entry->hash = hash;
+        entry->id = spice_create_image (b);
+        entry->cached = width * height <= IMAGE_CACHE_SMALL_AREA;
+    }
+
+    QXL_SET_IMAGE_ID (image, QXL_IMAGE_GROUP_DEVICE, entry->id);
+    image->descriptor.flags = entry->cached ? QXL_IMAGE_CACHE : 0;
+}
+
+/* Returns TRUE if all pixels of the box have the same color. The
+ * inner loop has no branches, so compiler vectorizes it, and the scan
+ * gives up on the first row which differs.
+ */
+static int
+box_is_uniform (const uint8_t *data, int32_t stride,
+        int width, int height, color_t *color)
+{
+    color_t first = *(const color_t *)data & 0x00ffffff;
+    const color_t *row;
+    color_t diff;
+    int x, y;
+
+    for (y = 0; y < height; ++y) {
+        row = (const color_t *)(data + y * stride);
+        diff = 0;
+        for (x = 0; x < width; ++x) {
+            diff |= (row[x] & 0x00ffffff) ^ first;
+        }
+        if (diff != 0) {
+            return FALSE;
+        }
+    }
+    *color = first | 0xff000000;
+    return TRUE;
+}
+
+static int
+paint_fill (struct spice_display *display, uint32_t surface_id,
+        const QXLRect *bbox, color_t color)
 {
+    struct spice_backend *b = display->backend;
+    struct drawable_cmd *cmd;
+    QXLDrawable *drawable;
+
+    cmd = spice_pool_get (&b->drawable_pool);
+    if (cmd == NULL) {
+        return -1;
+    }
+    drawable = &cmd->drawable;
+    init_drawable (drawable, QXL_DRAW_FILL, bbox, surface_id,
+            (intptr_t)cmd, display->frame_mm_time);
+
+    drawable->u.fill.brush.type     = SPICE_BRUSH_TYPE_SOLID;
+    drawable->u.fill.brush.u.color  = color;
+    drawable->u.fill.rop_descriptor = SPICE_ROPD_OP_PUT;
+    drawable->u.fill.mask.flags     = 0;
+    drawable->u.fill.mask.pos.x     = 0;
+    drawable->u.fill.mask.pos.y     = 0;
+    drawable->u.fill.mask.bitmap    = 0;
+
+    set_cmd (&cmd->ext, QXL_CMD_DRAW, (intptr_t)drawable);
+    if (!b->push_command (display, &cmd->ext)) {
+        cmd->base.destructor (&cmd->base);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+paint_box (struct spice_display *display, uint32_t surface_id,
+        const pixman_box32_t *box, struct spice_snapshot *snapshot,
+        int video, const uint64_t *rows)
+{
+    struct spice_backend *b = display->backend;
+    intptr_t data = (intptr_t)pixman_image_get_data (snapshot->image);
+    int32_t stride = pixman_image_get_stride (snapshot->image);
     struct create_image_cmd *cmd;
     QXLImage *image;
     QXLDrawable *drawable;
-    uint32_t surface_id = spice_get_primary_surface_id(b);
+    color_t color;
     QXLRect bbox = {
-        .left = x,
-        .right = x + width,
-        .top = y,
-        .bottom = y + height,
+        .left = box->x1,
+        .right = box->x2,
+        .top = box->y1,
+        .bottom = box->y2,
     };
 
-    cmd = calloc (sizeof *cmd, 1);
+    /* Backgrounds, fades and the like need no bitmap at all */
+    if (!video && box_is_uniform ((const uint8_t *)data + box->y1 * stride +
+                box->x1 * 4, stride,
+                box->x2 - box->x1, box->y2 - box->y1, &color))
+    {
+        return paint_fill (display, surface_id, &bbox, color);
+    }
+
+    cmd = spice_pool_get (&b->image_pool);
     if ( cmd == NULL ) {
         goto err_cmd_malloc;
     }
     drawable = &cmd->drawable;
     image = &cmd->image;
-    cmd->base.destructor = release_simple;
+    cmd->base.destructor = release_image;
+    cmd->snapshot = snapshot;
+    spice_snapshot_ref (snapshot);
 
-    if ( make_drawable (&bbox, surface_id, damage,
+    if ( make_drawable (&bbox, surface_id,
             (intptr_t) cmd, (intptr_t) image, drawable,
-            b->mm_clock) < 0 )
+            display->frame_mm_time) < 0 )
     {
         goto err_drawable;
     }
 
-    QXL_SET_IMAGE_ID (image, QXL_IMAGE_GROUP_DEVICE, image_id);
+    /* Point into the frame, no copying: stride stays the frame's one */
+    data += box->y1 * stride + box->x1 * 4;
+
+    if (video) {
+        /* Every frame is new content, and red_worker streams only
+         * bitmaps which are not cached.
+         */
+        QXL_SET_IMAGE_ID (image, QXL_IMAGE_GROUP_DEVICE,
+                spice_create_image (b));
+        image->descriptor.flags = 0;
+    } else {
+        set_image_id (b, image, (const uint8_t *)data, stride,
+                box->x2 - box->x1, box->y2 - box->y1, rows);
+    }
 
     image->descriptor.type      = SPICE_IMAGE_TYPE_BITMAP;
-    image->descriptor.flags     = 0;
-    image->descriptor.width     = image->bitmap.x = width;
-    image->descriptor.height    = image->bitmap.y = height;
+    image->descriptor.width     = image->bitmap.x = box->x2 - box->x1;
+    image->descriptor.height    = image->bitmap.y = box->y2 - box->y1;
 
     image->bitmap.data          = data;
     image->bitmap.flags         = QXL_BITMAP_DIRECT | QXL_BITMAP_TOP_DOWN;
@@ -213,12 +487,349 @@ spice_paint_image (struct spice_backend *b, uint32_t image_id,
 
     set_cmd (&cmd->ext, QXL_CMD_DRAW, (intptr_t)drawable);
 
-    b->push_command (b, &cmd->ext);
+    if (!b->push_command (display, &cmd->ext)) {
+        goto err_push;
+    }
 
     return 0;
 
+err_push:
 err_drawable:
-    free (cmd);
+    release_image (&cmd->base);
 err_cmd_malloc:
     return -1;
 }
+
+/* Turns damage into the boxes which are going to be sent: its extents
+ * when it has too many of them. Snapshots have to be taken of the
+ * reduced damage, each bitmap is read whole.
+ */
+void
+spice_damage_reduce (pixman_region32_t *damage)
+{
+    pixman_box32_t extents;
+
+    if (pixman_region32_n_rects (damage) > MAX_DAMAGE_BOXES) {
+        extents = *pixman_region32_extents (damage);
+        pixman_region32_fini (damage);
+        pixman_region32_init_rect (damage, extents.x1, extents.y1,
+                extents.x2 - extents.x1, extents.y2 - extents.y1);
+    }
+}
+
+/* Region is reduced by spice_damage_reduce already */
+static int
+paint_region (struct spice_display *display, uint32_t surface_id,
+        struct spice_snapshot *snapshot, pixman_region32_t *region,
+        const struct spice_moves *moves)
+{
+    pixman_box32_t *boxes;
+    const uint64_t *rows;
+    int n_boxes, i;
+
+    boxes = pixman_region32_rectangles (region, &n_boxes);
+    assert (n_boxes <= MAX_DAMAGE_BOXES);
+
+    for (i = 0; i < n_boxes; ++i) {
+        rows = moves != NULL ? spice_moves_find_rows (moves, &boxes[i]) :
+            NULL;
+        if (paint_box (display, surface_id, &boxes[i], snapshot,
+                    FALSE, rows) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Sends the damaged part of the snapshot of frame at (x,y) global
+ * position to display's primary surface. Damage is in global
+ * coordinates, one QXL_DRAW_COPY is emitted per damaged box, each one
+ * with its own bitmap covering only that box.
+ */
+int
+spice_paint_image (struct spice_display *display,
+        int x, int y, int width, int height,
+        struct spice_snapshot *snapshot, pixman_region32_t *damage,
+        const struct spice_moves *moves)
+{
+    pixman_region32_t region;
+    int ret;
+
+    pixman_region32_init (&region);
+    pixman_region32_intersect_rect (&region, damage, x, y, width, height);
+    pixman_region32_translate (&region, -x, -y);
+
+    ret = paint_region (display, PRIMARY_SURFACE_ID, snapshot, &region,
+            moves);
+
+    pixman_region32_fini (&region);
+    return ret;
+}
+
+/* Video frame: the whole box (frame coordinates) in one bitmap. Sent
+ * at the same place and size every frame, red_worker turns it into a
+ * stream.
+ */
+int
+spice_paint_video (struct spice_display *display,
+        struct spice_snapshot *snapshot, const pixman_box32_t *box)
+{
+    return paint_box (display, PRIMARY_SURFACE_ID, box, snapshot, TRUE,
+            NULL);
+}
+
+/* Same as spice_paint_image for an offscreen surface, damage is in
+ * its own coordinates and snapshot is of its size.
+ */
+int
+spice_paint_surface (struct spice_display *display, uint32_t surface_id,
+        struct spice_snapshot *snapshot, pixman_region32_t *damage)
+{
+    return paint_region (display, surface_id, snapshot, damage, NULL);
+}
+
+int
+spice_create_surface (struct spice_display *display, uint32_t surface_id,
+        int width, int height, uint8_t *data)
+{
+    struct surface_cmd *cmd;
+
+    cmd = zalloc (sizeof *cmd);
+    if (cmd == NULL) {
+        return -1;
+    }
+    cmd->base.destructor = release_simple;
+
+    set_release_info (&cmd->cmd.release_info, (intptr_t)cmd);
+    cmd->cmd.surface_id = surface_id;
+    cmd->cmd.type = QXL_SURFACE_CMD_CREATE;
+    cmd->cmd.flags = 0;
+    cmd->cmd.u.surface_create.format = SPICE_SURFACE_FMT_32_xRGB;
+    cmd->cmd.u.surface_create.width = width;
+    cmd->cmd.u.surface_create.height = height;
+    cmd->cmd.u.surface_create.stride = width * 4;
+    cmd->cmd.u.surface_create.data = (intptr_t)data;
+
+    set_cmd (&cmd->ext, QXL_CMD_SURFACE, (intptr_t)&cmd->cmd);
+    if (!display->backend->push_command (display, &cmd->ext)) {
+        free (cmd);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+release_surface_destroy (struct spice_release_info *base)
+{
+    struct surface_cmd *cmd = (struct surface_cmd *)base;
+
+    free (cmd->data);
+    free (cmd);
+}
+
+/* Memory of the surface is freed once red_worker is done with it */
+int
+spice_destroy_surface (struct spice_display *display, uint32_t surface_id,
+        uint8_t *data)
+{
+    struct surface_cmd *cmd;
+
+    cmd = zalloc (sizeof *cmd);
+    if (cmd == NULL) {
+        return -1;
+    }
+    cmd->base.destructor = release_surface_destroy;
+    cmd->data = data;
+
+    set_release_info (&cmd->cmd.release_info, (intptr_t)cmd);
+    cmd->cmd.surface_id = surface_id;
+    cmd->cmd.type = QXL_SURFACE_CMD_DESTROY;
+
+    set_cmd (&cmd->ext, QXL_CMD_SURFACE, (intptr_t)&cmd->cmd);
+    if (!display->backend->push_command (display, &cmd->ext)) {
+        free (cmd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Composes offscreen surface onto primary: (src_x,src_y) of the
+ * surface goes to dest.
+ */
+int
+spice_draw_surface (struct spice_display *display, uint32_t surface_id,
+        int width, int height, const pixman_box32_t *dest,
+        int src_x, int src_y)
+{
+    struct spice_backend *b = display->backend;
+    struct create_image_cmd *cmd;
+    QXLDrawable *drawable;
+    QXLImage *image;
+    QXLRect bbox = {
+        .left = dest->x1,
+        .right = dest->x2,
+        .top = dest->y1,
+        .bottom = dest->y2,
+    };
+
+    cmd = spice_pool_get (&b->image_pool);
+    if (cmd == NULL) {
+        return -1;
+    }
+    cmd->base.destructor = release_image;
+    drawable = &cmd->drawable;
+    image = &cmd->image;
+
+    image->descriptor.id = 0;
+    image->descriptor.type = SPICE_IMAGE_TYPE_SURFACE;
+    image->descriptor.flags = 0;
+    image->descriptor.width = width;
+    image->descriptor.height = height;
+    image->surface_image.surface_id = surface_id;
+
+    make_drawable (&bbox, PRIMARY_SURFACE_ID, (intptr_t)cmd,
+            (intptr_t)image, drawable, display->frame_mm_time);
+    drawable->u.copy.src_area.left = src_x;
+    drawable->u.copy.src_area.top = src_y;
+    drawable->u.copy.src_area.right = src_x + dest->x2 - dest->x1;
+    drawable->u.copy.src_area.bottom = src_y + dest->y2 - dest->y1;
+    /* red_worker has to render the source before this */
+    drawable->surfaces_dest[0] = surface_id;
+    drawable->surfaces_rects[0] = drawable->u.copy.src_area;
+
+    set_cmd (&cmd->ext, QXL_CMD_DRAW, (intptr_t)drawable);
+    if (!b->push_command (display, &cmd->ext)) {
+        release_image (&cmd->base);
+        return -1;
+    }
+    return 0;
+}
+
+/* Makes red_worker copy pixels it already has from (src_x,src_y) to
+ * dest, both on display's primary surface.
+ */
+int
+spice_copy_bits (struct spice_display *display, const pixman_box32_t *dest,
+        int src_x, int src_y)
+{
+    struct spice_backend *b = display->backend;
+    struct drawable_cmd *cmd;
+    QXLRect bbox = {
+        .left = dest->x1,
+        .right = dest->x2,
+        .top = dest->y1,
+        .bottom = dest->y2,
+    };
+
+    cmd = spice_pool_get (&b->drawable_pool);
+    if (cmd == NULL) {
+        return -1;
+    }
+    init_drawable (&cmd->drawable, QXL_COPY_BITS, &bbox,
+            PRIMARY_SURFACE_ID, (intptr_t)cmd, display->frame_mm_time);
+    cmd->drawable.u.copy_bits.src_pos.x = src_x;
+    cmd->drawable.u.copy_bits.src_pos.y = src_y;
+
+    set_cmd (&cmd->ext, QXL_CMD_DRAW, (intptr_t)&cmd->drawable);
+    if (!b->push_command (display, &cmd->ext)) {
+        cmd->base.destructor (&cmd->base);
+        return -1;
+    }
+    return 0;
+}
+
+/* Identifies cursor shape for spice's cursor cache, never 0 which
+ * means "do not cache".
+ */
+uint64_t
+spice_cursor_unique (const uint8_t *data, int32_t stride,
+        int width, int height, int hot_x, int hot_y)
+{
+    uint64_t hash = hash_box (data, stride, width, height, NULL);
+
+    hash = (hash ^ (((uint64_t)hot_x << 16) | hot_y)) * 0x100000001b3ULL;
+    return hash != 0 ? hash : 1;
+}
+
+static int
+push_cursor (struct spice_display *display, struct spice_release_info *base,
+        QXLCommandExt *ext, QXLCursorCmd *cmd)
+{
+    set_release_info (&cmd->release_info, (intptr_t)base);
+    set_cmd (ext, QXL_CMD_CURSOR, (intptr_t)cmd);
+
+    if (!display->backend->push_cursor_command (display, ext)) {
+        base->destructor (base);
+        return -1;
+    }
+    return 0;
+}
+
+/* Sets premultiplied ARGB shape with hot spot at (x,y) of display */
+int
+spice_cursor_set (struct spice_display *display,
+        const uint8_t *data, int32_t stride, int width, int height,
+        int hot_x, int hot_y, int x, int y, uint64_t unique)
+{
+    struct cursor_set_cmd *cmd;
+    uint32_t size = width * height * 4;
+    int i;
+
+    cmd = zalloc (sizeof *cmd + size);
+    if (cmd == NULL) {
+        return -1;
+    }
+    cmd->base.destructor = release_simple;
+
+    cmd->cursor.header.unique       = unique;
+    cmd->cursor.header.type         = SPICE_CURSOR_TYPE_ALPHA;
+    cmd->cursor.header.width        = width;
+    cmd->cursor.header.height       = height;
+    cmd->cursor.header.hot_spot_x   = hot_x;
+    cmd->cursor.header.hot_spot_y   = hot_y;
+    cmd->cursor.data_size           = size;
+    cmd->cursor.chunk.data_size     = size;
+    cmd->cursor.chunk.prev_chunk    = 0;
+    cmd->cursor.chunk.next_chunk    = 0;
+    for (i = 0; i < height; ++i) {
+        memcpy (cmd->cursor.chunk.data + i * width * 4,
+                data + i * stride, width * 4);
+    }
+
+    cmd->cmd.type               = QXL_CURSOR_SET;
+    cmd->cmd.u.set.position.x   = x;
+    cmd->cmd.u.set.position.y   = y;
+    cmd->cmd.u.set.visible      = TRUE;
+    cmd->cmd.u.set.shape        = (intptr_t)&cmd->cursor;
+
+    return push_cursor (display, &cmd->base, &cmd->ext, &cmd->cmd);
+}
+
+int
+spice_cursor_move (struct spice_display *display, int x, int y)
+{
+    struct cursor_cmd *cmd = spice_pool_get (&display->cursor_pool);
+
+    if (cmd == NULL) {
+        return -1;
+    }
+    cmd->cmd.type = QXL_CURSOR_MOVE;
+    cmd->cmd.u.position.x = x;
+    cmd->cmd.u.position.y = y;
+
+    return push_cursor (display, &cmd->base, &cmd->ext, &cmd->cmd);
+}
+
+int
+spice_cursor_hide (struct spice_display *display)
+{
+    struct cursor_cmd *cmd = spice_pool_get (&display->cursor_pool);
+
+    if (cmd == NULL) {
+        return -1;
+    }
+    cmd->cmd.type = QXL_CURSOR_HIDE;
+
+    return push_cursor (display, &cmd->base, &cmd->ext, &cmd->cmd);
+}
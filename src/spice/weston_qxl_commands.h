@@ -26,6 +26,8 @@
 #include "compositor-spice.h"
 #include "weston_spice_interfaces.h"
 
+struct spice_moves;
+
 #define COLOR_RGB(r,g,b) \
     (((r)<<16) | ((g)<<8) | ((b)<<0) | 0xff000000)
 
@@ -42,16 +44,110 @@
 
 typedef uint32_t color_t;
 
-uint32_t
-spice_create_primary_surface (struct spice_backend *b,
+/* Copy of the frame handed to red_worker. The output holds one
+ * reference and every unreleased drawable made from it holds another,
+ * so it is not reused while red_worker may read it, and it outlives
+ * the output's mode if needed.
+ */
+struct spice_snapshot {
+    pixman_image_t *image;
+    uint32_t refs;      /* changed atomically */
+};
+
+/* Above this number of damaged boxes it is cheaper to send the
+ * extents of the damage at once than to flood red_worker with tiny
+ * drawables. This is also the most commands one frame may push.
+ */
+#define MAX_DAMAGE_BOXES 32
+
+void
+spice_damage_reduce (pixman_region32_t *damage);
+
+int
+spice_qxl_commands_init (struct spice_backend *b);
+
+void
+spice_qxl_commands_destroy (struct spice_backend *b);
+
+void
+spice_create_primary_surface (struct spice_display *display,
         int width, int height, uint8_t *data);
 
+void
+spice_reset_primary_surface (struct spice_display *display,
+        int width, int height, uint8_t *data);
+
+int
+spice_display_commands_init (struct spice_display *display);
+
+void
+spice_display_commands_destroy (struct spice_display *display);
+
 uint32_t
 spice_create_image (struct spice_backend *b);
 
+struct spice_snapshot *
+spice_snapshot_create (int width, int height);
+
+void
+spice_snapshot_ref (struct spice_snapshot *snapshot);
+
+void
+spice_snapshot_unref (struct spice_snapshot *snapshot);
+
+static inline int
+spice_snapshot_is_busy (struct spice_snapshot *snapshot)
+{
+    return __atomic_load_n (&snapshot->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/* Bitmaps of boxes scroll detection has hashed take their image ids
+ * from moves, which may be NULL.
+ */
 int
-spice_paint_image (struct spice_backend *b, uint32_t image_id,
+spice_paint_image (struct spice_display *display,
         int x, int y, int width, int wight,
-        intptr_t data, int32_t stride,
-        pixman_region32_t *region);
+        struct spice_snapshot *snapshot,
+        pixman_region32_t *region,
+        const struct spice_moves *moves);
+
+int
+spice_paint_video (struct spice_display *display,
+        struct spice_snapshot *snapshot, const pixman_box32_t *box);
+
+int
+spice_paint_surface (struct spice_display *display, uint32_t surface_id,
+        struct spice_snapshot *snapshot, pixman_region32_t *damage);
+
+int
+spice_create_surface (struct spice_display *display, uint32_t surface_id,
+        int width, int height, uint8_t *data);
+
+int
+spice_destroy_surface (struct spice_display *display, uint32_t surface_id,
+        uint8_t *data);
+
+int
+spice_draw_surface (struct spice_display *display, uint32_t surface_id,
+        int width, int height, const pixman_box32_t *dest,
+        int src_x, int src_y);
+
+int
+spice_copy_bits (struct spice_display *display, const pixman_box32_t *dest,
+        int src_x, int src_y);
+
+uint64_t
+spice_cursor_unique (const uint8_t *data, int32_t stride,
+        int width, int height, int hot_x, int hot_y);
+
+int
+spice_cursor_set (struct spice_display *display,
+        const uint8_t *data, int32_t stride, int width, int height,
+        int hot_x, int hot_y, int x, int y, uint64_t unique);
+
+int
+spice_cursor_move (struct spice_display *display, int x, int y);
+
+int
+spice_cursor_hide (struct spice_display *display);
 #endif //WESTON_QXL_COMMANDS_H
@@ -0,0 +1,203 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include <spice.h>
+#include <spice/macros.h>
+
+#include "compositor-spice.h"
+#include "weston_qxl_compression.h"
+
+/* Average time red_worker takes to get all drawables of a frame, ms,
+ * below which the link looks local and above which it looks congested
+ */
+#define LAN_DRAIN           10
+#define CONGESTED_DRAIN     100
+
+#if SPICE_SERVER_VERSION >= 0x000c06
+#define LAN_IMAGE_COMPRESSION       SPICE_IMAGE_COMPRESS_LZ4
+#define LAN_IMAGE_COMPRESSION_NAME  "lz4"
+#else
+#define LAN_IMAGE_COMPRESSION       SPICE_IMAGE_COMPRESS_LZ
+#define LAN_IMAGE_COMPRESSION_NAME  "lz"
+#endif
+
+static const struct {
+    const char *name;
+    spice_image_compression_t image;
+    const char *image_name;
+    spice_wan_compression_t wan;
+    const char *wan_name;
+    int frame_divider;
+} link_settings[] = {
+    [SPICE_LINK_LAN] = {
+        "LAN", LAN_IMAGE_COMPRESSION, LAN_IMAGE_COMPRESSION_NAME,
+        SPICE_WAN_COMPRESSION_NEVER, "never", 1,
+    },
+    [SPICE_LINK_WAN] = {
+        "WAN", SPICE_IMAGE_COMPRESS_AUTO_GLZ, "auto_glz",
+        SPICE_WAN_COMPRESSION_AUTO, "auto", 1,
+    },
+    [SPICE_LINK_CONGESTED] = {
+        "congested", SPICE_IMAGE_COMPRESS_GLZ, "glz",
+        SPICE_WAN_COMPRESSION_ALWAYS, "always", 2,
+    },
+};
+
+void
+spice_compression_init (struct spice_compression *compression,
+        int adaptive, int jpeg_fixed, int zlib_glz_fixed)
+{
+    compression->adaptive = adaptive;
+    compression->jpeg_fixed = jpeg_fixed;
+    compression->zlib_glz_fixed = zlib_glz_fixed;
+
+    /* Server starts with auto_glz, which is what WAN gets */
+    compression->link = SPICE_LINK_WAN;
+    compression->candidate = SPICE_LINK_WAN;
+    compression->candidate_periods = 0;
+    compression->period_start = spice_get_monotonic_msec ();
+    compression->ring_peak = 0;
+    compression->drain_msec = 0;
+    compression->drain_frames = 0;
+    compression->frame_divider = 1;
+}
+
+/* red_worker stops getting commands while its pipe to the client is
+ * full, so the time it takes to drain a frame follows the link. Release
+ * latency does not: drawables are released when overdrawn, which is up
+ * to the clients.
+ */
+static enum spice_link
+judge_link (const struct spice_compression *compression, int level)
+{
+    uint64_t drain = compression->drain_msec / compression->drain_frames;
+
+    if (compression->ring_peak > MAX_COMMAND_NUM / 2 ||
+            drain > CONGESTED_DRAIN)
+    {
+        return SPICE_LINK_CONGESTED;
+    }
+    /* Level above zero is the server asking displays to compress */
+    if (compression->ring_peak < MAX_COMMAND_NUM / 16 &&
+            drain < LAN_DRAIN && level == 0)
+    {
+        return SPICE_LINK_LAN;
+    }
+    return SPICE_LINK_WAN;
+}
+
+static void
+apply_link (struct spice_backend *b, enum spice_link link, int level)
+{
+    struct spice_compression *compression = &b->compression;
+
+    weston_log ("Spice link looks %s (ring peak %u, frame drain "
+            "%u ms, server level %d): image compression %s, "
+            "jpeg %s, zlib-glz %s, every %d frame(s) sent\n",
+            link_settings[link].name, compression->ring_peak,
+            (uint32_t)(compression->drain_msec / compression->drain_frames),
+            level,
+            link_settings[link].image_name,
+            compression->jpeg_fixed ?
+                "as configured" : link_settings[link].wan_name,
+            compression->zlib_glz_fixed ?
+                "as configured" : link_settings[link].wan_name,
+            link_settings[link].frame_divider);
+
+    spice_server_set_image_compression (b->spice_server,
+            link_settings[link].image);
+    if (!compression->jpeg_fixed) {
+        spice_server_set_jpeg_compression (b->spice_server,
+                link_settings[link].wan);
+    }
+    if (!compression->zlib_glz_fixed) {
+        spice_server_set_zlib_glz_compression (b->spice_server,
+                link_settings[link].wan);
+    }
+    compression->frame_divider = link_settings[link].frame_divider;
+    compression->link = link;
+}
+
+void
+spice_compression_sample (struct spice_backend *b,
+        struct spice_display *display, uint64_t frame_nsec)
+{
+    struct spice_compression *compression = &b->compression;
+    uint64_t consumed;
+    uint32_t now, depth;
+    enum spice_link link;
+    int level;
+
+    if (!compression->adaptive) {
+        return;
+    }
+
+    depth = MAX_COMMAND_NUM - b->commands_free (display);
+    if (depth > compression->ring_peak) {
+        compression->ring_peak = depth;
+    }
+    /* Not drained yet counts as far as it has got */
+    if (frame_nsec != 0) {
+        consumed = __atomic_load_n (&display->consumed_nsec,
+                __ATOMIC_RELAXED);
+        if (consumed < frame_nsec) {
+            consumed = spice_get_monotonic_nsec ();
+        }
+        compression->drain_msec += (consumed - frame_nsec) / 1000000;
+        compression->drain_frames++;
+    }
+
+    now = spice_get_monotonic_msec ();
+    if (now - compression->period_start < COMPRESSION_PERIOD) {
+        return;
+    }
+
+    /* Nothing was sent, nothing to judge by */
+    if (compression->drain_frames == 0) {
+        goto out;
+    }
+
+    level = __atomic_load_n (&display->compression_level, __ATOMIC_RELAXED);
+    link = judge_link (compression, level);
+    if (link == compression->link) {
+        compression->candidate_periods = 0;
+    } else if (link == compression->candidate) {
+        compression->candidate_periods++;
+    } else {
+        compression->candidate = link;
+        compression->candidate_periods = 1;
+    }
+    if (compression->candidate_periods >= COMPRESSION_HYSTERESIS) {
+        apply_link (b, link, level);
+        compression->candidate_periods = 0;
+    }
+
+out:
+    compression->period_start = now;
+    compression->ring_peak = 0;
+    compression->drain_msec = 0;
+    compression->drain_frames = 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef WESTON_QXL_COMPRESSION_H
+#define WESTON_QXL_COMPRESSION_H
+
+#include <stdint.h>
+#include <spice.h>
+
+struct spice_backend;
+struct spice_display;
+
+/* Period over which the link is judged, ms */
+#define COMPRESSION_PERIOD 1000
+/* Periods which must agree before compression is switched */
+#define COMPRESSION_HYSTERESIS 2
+
+/* What the session's link looks like to the controller */
+enum spice_link {
+    SPICE_LINK_LAN = 0,
+    SPICE_LINK_WAN,
+    SPICE_LINK_CONGESTED,
+};
+
+/* Switches image compression of the session as the link changes. It
+ * watches how far red_worker is behind the command rings, how long it
+ * takes to drain a frame's commands and the level the server asks
+ * displays for.
+ */
+struct spice_compression {
+    int adaptive;
+    int jpeg_fixed, zlib_glz_fixed;
+
+    enum spice_link link;
+    enum spice_link candidate;
+    int candidate_periods;
+
+    uint32_t period_start;
+    uint32_t ring_peak;
+    /* Push to get_command of the last drawable, frames which pushed */
+    uint64_t drain_msec;
+    uint32_t drain_frames;
+
+    /* Frames are sent every frame_divider-th refresh */
+    int frame_divider;
+};
+
+/* Leaves compression as configured unless adaptive is set. Fixed
+ * jpeg and zlib-glz settings are not touched by the controller.
+ */
+void
+spice_compression_init (struct spice_compression *compression,
+        int adaptive, int jpeg_fixed, int zlib_glz_fixed);
+
+/* Called at the end of every frame of display, frame_nsec is when
+ * the frame started pushing drawables, 0 if it did not
+ */
+void
+spice_compression_sample (struct spice_backend *b,
+        struct spice_display *display, uint64_t frame_nsec);
+
+#endif //WESTON_QXL_COMPRESSION_H
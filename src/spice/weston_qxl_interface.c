@@ -29,8 +29,10 @@
 #include <spice/qxl_dev.h>
 #include <spice.h>
 #include <spice/macros.h>
+#include <spice/vd_agent.h>
 #include <wayland-util.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "weston_spice_interfaces.h"
 #include "compositor-spice.h"
@@ -46,52 +48,241 @@ QXLDevMemSlot slot = {
 .qxl_ram_size = ~0,
 };
 
-#define MAX_COMMAND_NUM 1024
-#define MAX_WAIT_ITERATIONS 10
-#define WAIT_ITERATION_TIME 100
+#define CACHELINE_SIZE 64
 
-static struct {
+/* Same as below, for cursor channel. Cursor commands are few and
+ * small, so this one lives apart not to be stuck behind drawables.
+ */
+struct cursor_ring {
+    QXLCommandExt *vector [MAX_CURSOR_COMMAND_NUM];
+
+    uint32_t end __attribute__ ((aligned (CACHELINE_SIZE)));
+    uint32_t start __attribute__ ((aligned (CACHELINE_SIZE)));
+};
+
+/* Single-producer/single-consumer ring of QXL commands. The compositor
+ * thread is the only one who advances end, the red_worker thread is the
+ * only one who advances start. Each index lives on its own cache line,
+ * so neither thread invalidates the line the other one is writing.
+ */
+struct weston_spice_qxl {
     QXLCommandExt *vector [MAX_COMMAND_NUM];
-    int start;
-    int end;
-} commands = {
-    .start = 0,
-    .end = 0,
+
+    uint32_t end __attribute__ ((aligned (CACHELINE_SIZE)));
+    uint32_t start __attribute__ ((aligned (CACHELINE_SIZE)));
+
+    /* Set by compositor when it waits for the ring to be drained,
+     * cleared by whoever notices the drain first.
+     */
+    uint32_t drain_wanted __attribute__ ((aligned (CACHELINE_SIZE)));
+    int drain_fd;
+    SpiceWatch *drain_watch;
+
+    struct cursor_ring cursor;
 };
 
-#define ASSERT_COMMANDS assert (\
-    (commands.end - commands.start <= MAX_COMMAND_NUM) && \
-    (commands.end >= commands.start) )
+static inline uint32_t
+ring_count (struct weston_spice_qxl *ring)
+{
+    return __atomic_load_n (&ring->end, __ATOMIC_ACQUIRE) -
+        __atomic_load_n (&ring->start, __ATOMIC_ACQUIRE);
+}
+
+static int
+commands_free (struct spice_display *display)
+{
+    return MAX_COMMAND_NUM - ring_count (display->qxl);
+}
 
+/* Returns TRUE if worker has already consumed every pushed command.
+ * Otherwise commands_drained hook will be called from the compositor
+ * loop once it does.
+ */
 static int
-push_command (spice_backend_t *qxl, QXLCommandExt *cmd)
+request_drain (struct spice_display *display)
+{
+    struct weston_spice_qxl *ring = display->qxl;
+
+    __atomic_store_n (&ring->drain_wanted, 1, __ATOMIC_SEQ_CST);
+    if (ring_count (ring) == 0 &&
+            __atomic_exchange_n (&ring->drain_wanted, 0, __ATOMIC_SEQ_CST))
+    {
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Called from red_worker thread */
+static void
+notify_drained (struct weston_spice_qxl *ring)
+{
+    uint64_t one = 1;
+
+    if (__atomic_load_n (&ring->drain_wanted, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n (&ring->drain_wanted, 0, __ATOMIC_SEQ_CST))
+    {
+        if (write (ring->drain_fd, &one, sizeof one) != sizeof one) {
+            weston_log("Failed to notify about drained command ring\n");
+        }
+    }
+}
+
+static void
+on_drained (int fd, int event, void *opaque)
+{
+    struct spice_display *display = opaque;
+    spice_backend_t *b = display->backend;
+    uint64_t count;
+
+    if (read (fd, &count, sizeof count) != sizeof count) {
+        return;
+    }
+    if (b->commands_drained) {
+        b->commands_drained (display);
+    }
+}
+
+/* Release info is on the top of all QXL commands */
+static struct spice_release_info *
+command_release_info (QXLCommandExt *ext)
 {
-    int i = 0;
-    int count;
+    QXLReleaseInfo *info = (QXLReleaseInfo *)(unsigned long) ext->cmd.data;
 
-    ASSERT_COMMANDS;
+    return (struct spice_release_info*)(unsigned long) info->id;
+}
 
-    while ( (count  = commands.end - commands.start) >= MAX_COMMAND_NUM) {
-        //may be decremented from worker thread.
-        if (i >= MAX_WAIT_ITERATIONS) {
-            weston_log("Spice command queue overload");
-            return FALSE;
+/* Bitmap memory the command keeps busy until it is released */
+static uint32_t
+command_bytes (QXLCommandExt *ext)
+{
+    QXLDrawable *drawable;
+    QXLImage *image;
+    QXLCursorCmd *cursor;
+
+    switch (ext->cmd.type) {
+    case QXL_CMD_DRAW:
+        drawable = (QXLDrawable *)(unsigned long) ext->cmd.data;
+        if (drawable->type != QXL_DRAW_COPY) {
+            return 0;
+        }
+        image = (QXLImage *)(unsigned long) drawable->u.copy.src_bitmap;
+        if (image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+            return 0;
         }
-        ++i;
-        usleep(WAIT_ITERATION_TIME);
+        return image->descriptor.width * image->descriptor.height * 4;
+    case QXL_CMD_CURSOR:
+        cursor = (QXLCursorCmd *)(unsigned long) ext->cmd.data;
+        if (cursor->type != QXL_CURSOR_SET) {
+            return 0;
+        }
+        return ((QXLCursor *)(unsigned long) cursor->u.set.shape)->data_size;
+    }
+    return 0;
+}
+
+static void
+account_push (struct spice_display *display, QXLCommandExt *ext)
+{
+    struct spice_release_info *ri = command_release_info (ext);
+
+    ri->push_msec = spice_get_monotonic_msec ();
+    ri->bytes = command_bytes (ext);
+    __atomic_add_fetch (&display->inflight_commands, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&display->inflight_bytes, ri->bytes,
+            __ATOMIC_RELAXED);
+    display->pushed_bytes += ri->bytes;
+}
+
+/* Returns TRUE when red_worker holds more than the display's budget.
+ * Then red_worker is told it is out of memory: it renders and releases
+ * drawables it keeps, and calls flush_resources. It is told again while
+ * nothing comes back; if that does not help either, FALSE is returned
+ * so that frames go on and overdraw what red_worker holds.
+ */
+static int
+over_budget (struct spice_display *display)
+{
+    uint32_t commands = __atomic_load_n (&display->inflight_commands,
+            __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_load_n (&display->inflight_bytes,
+            __ATOMIC_RELAXED);
+    uint32_t now;
+
+    if (commands <= MAX_INFLIGHT_COMMANDS && bytes <= MAX_INFLIGHT_BYTES) {
+        display->reclaiming = FALSE;
+        return FALSE;
+    }
+    now = spice_get_monotonic_msec ();
+    if (!display->reclaiming) {
+        weston_log ("Spice display %d holds %u commands, %u KiB, "
+                "reclaiming\n", display->display_sin.id,
+                commands, (uint32_t)(bytes >> 10));
+        display->reclaiming = TRUE;
+        display->reclaim_retries = 0;
+    } else if (commands < display->reclaim_commands) {
+        /* Still giving back */
+        display->reclaim_commands = commands;
+        display->reclaim_retries = 0;
+        return TRUE;
+    } else if (display->reclaim_retries >= RECLAIM_MAX_RETRIES) {
+        return FALSE;
+    } else if (now - display->reclaim_msec < RECLAIM_RETRY_MSEC) {
+        return TRUE;
+    } else if (++display->reclaim_retries == RECLAIM_MAX_RETRIES) {
+        weston_log ("Spice display %d gives nothing back, pushing frames "
+                "over budget\n", display->display_sin.id);
+        return FALSE;
+    }
+    display->reclaim_commands = commands;
+    display->reclaim_msec = now;
+    spice_qxl_oom (&display->display_sin);
+    return TRUE;
+}
+
+/* Never blocks: when the ring is full the command is rejected and the
+ * caller is expected to keep its damage for the next frame.
+ */
+static int
+push_command (struct spice_display *display, QXLCommandExt *cmd)
+{
+    struct weston_spice_qxl *ring = display->qxl;
+    uint32_t end = ring->end;
+
+    if (end - __atomic_load_n (&ring->start, __ATOMIC_ACQUIRE) >=
+            MAX_COMMAND_NUM)
+    {
+        return FALSE;
+    }
+    account_push (display, cmd);
+    ring->vector[end % MAX_COMMAND_NUM] = cmd;
+    __atomic_store_n (&ring->end, end + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+static int
+push_cursor_command (struct spice_display *display, QXLCommandExt *cmd)
+{
+    struct cursor_ring *ring = &display->qxl->cursor;
+    uint32_t end = ring->end;
+
+    if (end - __atomic_load_n (&ring->start, __ATOMIC_ACQUIRE) >=
+            MAX_CURSOR_COMMAND_NUM)
+    {
+        return FALSE;
     }
-    commands.vector[commands.end % MAX_COMMAND_NUM] = cmd;
-    ++commands.end;
+    account_push (display, cmd);
+    ring->vector[end % MAX_CURSOR_COMMAND_NUM] = cmd;
+    __atomic_store_n (&ring->end, end + 1, __ATOMIC_RELEASE);
     return TRUE;
 }
 
 static void
 weston_spice_attache_worker (QXLInstance *sin, QXLWorker *qxl_worker)
 {
-    spice_backend_t *qxl = wl_container_of(sin, qxl, display_sin);
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
 
-    if (qxl->worker != NULL) { //Only one worker per session
-        if (qxl->worker == qxl_worker) {
+    if (display->worker != NULL) { //Only one worker per display
+        if (display->worker == qxl_worker) {
             weston_log("Superfluous %s ignored", __func__);
         } else {
             weston_log("Superfluous %s with different worker ignored",
@@ -99,28 +290,38 @@ weston_spice_attache_worker (QXLInstance *sin, QXLWorker *qxl_worker)
         }
         return;
     }
-    spice_qxl_add_memslot(&qxl->display_sin, &slot);
+    spice_qxl_add_memslot(&display->display_sin, &slot);
 
-    qxl->worker = qxl_worker;
+    display->worker = qxl_worker;
 }
 static void
 weston_spice_set_compression_level (QXLInstance *sin, int level)
 {
-    spice_backend_t *qxl = wl_container_of(sin, qxl, display_sin);
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
 
-    //FIXME implement
+    /* Server derives it from its own compression settings, the
+     * controller takes it into account.
+     */
+    if (__atomic_exchange_n (&display->compression_level, level,
+                __ATOMIC_RELAXED) != level)
+    {
+        weston_log ("Spice server set compression level %d on display %d\n",
+                level, sin->id);
+    }
 }
 static void
 weston_spice_set_mm_time(QXLInstance *sin, uint32_t mm_time)
 {
-    spice_backend_t *qxl = wl_container_of(sin, qxl, display_sin);
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
 
-    qxl->mm_clock = mm_time;
+    __atomic_store_n (&display->backend->mm_clock,
+            (uint64_t)mm_time << 32 | spice_get_monotonic_msec (),
+            __ATOMIC_RELEASE);
 }
 static void
 weston_spice_get_init_info(QXLInstance *sin, QXLDevInitInfo *info)
 {
-    spice_backend_t *qxl = wl_container_of(sin, qxl, display_sin);
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
 
     memset (info,0,sizeof(*info));
 
@@ -128,34 +329,39 @@ weston_spice_get_init_info(QXLInstance *sin, QXLDevInitInfo *info)
     info->num_memslots_groups = NUM_MEMSLOTS_GROUPS;
     info->memslot_id_bits = MEMSLOT_ID_BITS;
     info->memslot_gen_bits = MEMSLOT_GEN_BITS;
-    info->n_surfaces = NUM_SURFACES;
+    info->n_surfaces = display->backend->num_surfaces;
 }
 static int
 weston_spice_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
 {
-    spice_backend_t *qxl = wl_container_of(sin, qxl, display_sin);
-    int count = commands.end - commands.start;
-
-    memset (ext,0,sizeof(*ext));
-
-    if (count > 0) {
-        *ext = *commands.vector[commands.start];
-        ++commands.start;
-        if ( commands.start >= MAX_COMMAND_NUM ) {
-            commands.start %= MAX_COMMAND_NUM;
-            commands.end %= MAX_COMMAND_NUM;
-        }
-        ASSERT_COMMANDS;
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
+    struct weston_spice_qxl *ring = display->qxl;
+    uint32_t start = ring->start;
 
-        return TRUE;
+    if (start == __atomic_load_n (&ring->end, __ATOMIC_ACQUIRE)) {
+        notify_drained (ring);
+        return FALSE;
+    }
+    *ext = *ring->vector[start % MAX_COMMAND_NUM];
+    /* Last command of the frame is taken, the frame is presented as far
+     * as compositor can tell. Stored before start, so whoever sees the
+     * ring empty sees the time as well.
+     */
+    if (start + 1 == __atomic_load_n (&ring->end, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n (&display->consumed_nsec,
+                spice_get_monotonic_nsec (), __ATOMIC_RELAXED);
     }
+    __atomic_store_n (&ring->start, start + 1, __ATOMIC_SEQ_CST);
 
-    return FALSE;
+    if (start + 1 == __atomic_load_n (&ring->end, __ATOMIC_ACQUIRE)) {
+        notify_drained (ring);
+    }
+    return TRUE;
 }
 static int
 weston_spice_req_cmd_notification(QXLInstance *sin)
 {
-    spice_backend_t *qxl = wl_container_of(sin, qxl, display_sin);
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
 
     /* This and req_cursor_notification needed for
      * client showing
@@ -166,125 +372,49 @@ static void
 weston_spice_release_resource(QXLInstance *sin,
                                        struct QXLReleaseInfoExt info)
 {
-    spice_backend_t *qxl = wl_container_of(sin, qxl, display_sin);
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
     struct spice_release_info *ri;
+    uint32_t latency;
 
     assert (info.group_id == MEMSLOT_GROUP);
     ri = (struct spice_release_info*)(unsigned long)info.info->id;
 
-    ri->destructor(ri);
-}
-
-/*
- * copy-paste from
- * spice/server/tests/test_display_base.b
- *
- * from here
- */
+    __atomic_sub_fetch (&display->inflight_commands, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch (&display->inflight_bytes, ri->bytes,
+            __ATOMIC_RELAXED);
+    __atomic_add_fetch (&display->released, 1, __ATOMIC_RELAXED);
 
-#define CURSOR_WIDTH 32
-#define CURSOR_HEIGHT 32
+    if (display->release_histogram != NULL) {
+        latency = spice_get_monotonic_msec () - ri->push_msec;
+        __atomic_add_fetch (&display->release_histogram[
+                MIN (latency, RELEASE_HISTOGRAM_SIZE - 1)], 1,
+                __ATOMIC_RELAXED);
+    }
 
-static struct {
-    QXLCursor cursor;
-    uint8_t data[CURSOR_WIDTH * CURSOR_HEIGHT * 4]; // 32bit per pixel
-} cursor;
-static void cursor_init(void)
-{
-    cursor.cursor.header.unique = 0;
-    cursor.cursor.header.type = SPICE_CURSOR_TYPE_COLOR32;
-    cursor.cursor.header.width = CURSOR_WIDTH;
-    cursor.cursor.header.height = CURSOR_HEIGHT;
-    cursor.cursor.header.hot_spot_x = 0;
-    cursor.cursor.header.hot_spot_y = 0;
-    cursor.cursor.data_size = CURSOR_WIDTH * CURSOR_HEIGHT * 4;
-
-    // X drivers addes it to the cursor size because it could be
-    // cursor data information or another cursor related stuffs.
-    // Otherwise, the code will break in client/cursor.cpp side,
-    // that expect the data_size plus cursor information.
-    // Blame cursor protocol for this. :-)
-    cursor.cursor.data_size += 128;
-    cursor.cursor.chunk.data_size = cursor.cursor.data_size;
-    cursor.cursor.chunk.prev_chunk = cursor.cursor.chunk.next_chunk = 0;
+    ri->destructor(ri);
 }
 
-/*
- * till here
- */
-
-struct cursor_cmd {
-    struct spice_release_info base;
-
-    QXLCommandExt ext;
-    QXLCursorCmd cursor_cmd;
-};
-
 static int
 weston_spice_get_cursor_command(QXLInstance *sin, struct QXLCommandExt *ext)
 {
-    spice_backend_t *b = wl_container_of(sin, b, display_sin);
-    static int set = TRUE;
-    struct cursor_cmd *cmd;
-    static wl_fixed_t x = 0, y = 0;
-    struct weston_pointer *pointer;
-
-    //Not used for now.
-    return FALSE;
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
+    struct cursor_ring *ring = &display->qxl->cursor;
+    uint32_t start = ring->start;
 
-    /*if (!b->core_seat.has_pointer) {
+    if (start == __atomic_load_n (&ring->end, __ATOMIC_ACQUIRE)) {
         return FALSE;
     }
-* looks like it depricated
-    */
-//    pointer = b->core_seat.pointer;
-
-    if ( !set &&
-            x == pointer->x &&
-            y == pointer->y )
-    {
-        return FALSE;
-    }
-
-    x = pointer->x;
-    y = pointer->y;
-
-    cmd = calloc (1, sizeof *cmd);
-    cmd->cursor_cmd.release_info.id = (unsigned long)cmd;
-    cmd->base.destructor = release_simple;
-
-    if (set) {
-        cursor_init();
-        cmd->cursor_cmd.type = QXL_CURSOR_SET;
-        cmd->cursor_cmd.u.set.position.x = 0;
-        cmd->cursor_cmd.u.set.position.y = 0;
-        cmd->cursor_cmd.u.set.visible = TRUE;
-        cmd->cursor_cmd.u.set.shape = (unsigned long)&cursor;
-        // only a white rect (32x32) as cursor
-        memset(cursor.data, 0xff, sizeof(cursor.data));
-        set = 0;
-    } else {
-        cmd->cursor_cmd.type = QXL_CURSOR_MOVE;
-        cmd->cursor_cmd.u.position.x = x;
-        cmd->cursor_cmd.u.position.y = y;
-    }
-
-    cmd->ext.cmd.data = (unsigned long)&cmd->cursor_cmd;
-    cmd->ext.cmd.type = QXL_CMD_CURSOR;
-    cmd->ext.group_id = MEMSLOT_GROUP;
-    cmd->ext.flags    = 0;
-    *ext = cmd->ext;
-
+    *ext = *ring->vector[start % MAX_CURSOR_COMMAND_NUM];
+    __atomic_store_n (&ring->start, start + 1, __ATOMIC_RELEASE);
     return TRUE;
 }
 static int
 weston_spice_req_cursor_notification(QXLInstance *sin)
 {
-    spice_backend_t *qxl = wl_container_of(sin, qxl, display_sin);
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
 
-    //FIXME implemet
-
-    /* This and req_cmd_notification needed for
+    /* Cursor commands are followed by spice_qxl_wakeup, as well as
+     * drawing ones. This and req_cmd_notification needed for
      * client showing
      */
     return TRUE;
@@ -292,20 +422,48 @@ weston_spice_req_cursor_notification(QXLInstance *sin)
 static void
 weston_spice_notify_update(QXLInstance *sin, uint32_t update_id)
 {
-    spice_backend_t *qxl = wl_container_of(sin, qxl, display_sin);
-
-    //FIXME implemet
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
 
+    /* Answers QXL_IO_UPDATE_AREA_ASYNC of a guest driver, compositor
+     * never asks red_worker to update an area.
+     */
 }
 static int
 weston_spice_flush_resources(QXLInstance *sin)
 {
-    spice_backend_t *qxl = wl_container_of(sin, qxl, display_sin);
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
 
-    //FIXME implemet
+    /* Called by red_worker handling out of memory. Commands are
+     * released straight away, nothing is held back in a release ring,
+     * so report what red_worker has released since the last call. With
+     * zero it frees some of its drawables and calls again.
+     */
+    return __atomic_exchange_n (&display->released, 0, __ATOMIC_RELAXED);
+}
+#if SPICE_SERVER_VERSION >= 0x000b04
+static int
+weston_spice_client_monitors_config(QXLInstance *sin,
+        VDAgentMonitorsConfig *monitors_config)
+{
+    struct spice_display *display = wl_container_of(sin, display, display_sin);
+    spice_backend_t *b = display->backend;
+    uint32_t head = display->display_sin.id;
 
-    return 0;
+    /* Called with NULL to check whether we support it */
+    if (monitors_config == NULL) {
+        return TRUE;
+    }
+    /* Every display gets the whole config, it takes its own head */
+    if (head >= monitors_config->num_of_monitors ||
+            b->client_monitors_config == NULL)
+    {
+        return FALSE;
+    }
+    return b->client_monitors_config (display,
+            monitors_config->monitors[head].width,
+            monitors_config->monitors[head].height);
 }
+#endif
 static QXLInterface weston_qxl_interface = {
     .base.type                  = SPICE_INTERFACE_QXL,
     .base.description           = "weston qxl gpu",
@@ -324,34 +482,118 @@ static QXLInterface weston_qxl_interface = {
     .req_cursor_notification    = weston_spice_req_cursor_notification,
     .notify_update              = weston_spice_notify_update,
     .flush_resources            = weston_spice_flush_resources,
+#if SPICE_SERVER_VERSION >= 0x000b04
+    .client_monitors_config     = weston_spice_client_monitors_config,
+#endif
 };
 
-void
-weston_spice_qxl_init (spice_backend_t *qxl)
+/* Registers display as a new QXL instance of the session. Display's
+ * backend must be set, red_worker is attached before this returns.
+ */
+int
+weston_spice_qxl_init (struct spice_display *display)
+{
+    spice_backend_t *b = display->backend;
+    struct weston_spice_qxl *ring;
+
+    if (posix_memalign ((void **)&ring, CACHELINE_SIZE, sizeof *ring) != 0) {
+        weston_log("Failed to allocate qxl command ring");
+        return -1;
+    }
+    memset (ring, 0, sizeof *ring);
+
+    ring->drain_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->drain_fd < 0) {
+        weston_log("Failed to create qxl drain notifier");
+        goto err_eventfd;
+    }
+    ring->drain_watch = b->core->watch_add (ring->drain_fd,
+            SPICE_WATCH_EVENT_READ, on_drained, display);
+    if (ring->drain_watch == NULL) {
+        goto err_watch;
+    }
+
+    display->display_sin.base.sif = &weston_qxl_interface.base;
+    display->display_sin.id = b->display_count;
+    display->display_sin.st = (struct QXLState*)display;
+    display->qxl = ring;
+    b->push_command = push_command;
+    b->push_cursor_command = push_cursor_command;
+    b->commands_free = commands_free;
+    b->request_drain = request_drain;
+    b->over_budget = over_budget;
+
+    if (spice_server_add_interface (b->spice_server,
+                &display->display_sin.base) != 0)
+    {
+        weston_log("Failed to add qxl interface #%d", b->display_count);
+        goto err_interface;
+    }
+    b->display_count++;
+
+    return 0;
+
+err_interface:
+    display->qxl = NULL;
+    b->core->watch_remove (ring->drain_watch);
+err_watch:
+    close (ring->drain_fd);
+err_eventfd:
+    free (ring);
+    return -1;
+}
+/* Takes display out of the session, its red_worker is gone once this
+ * returns. Servers before 0.14 can't remove QXL instances, the display
+ * has to outlive the server then.
+ */
+int
+weston_spice_qxl_remove (struct spice_display *display)
 {
-    static int qxl_count = 0;
+#if SPICE_SERVER_VERSION >= 0x000e00
+    spice_backend_t *b = display->backend;
 
-    if ( ++qxl_count > 1 ) {
-        weston_log("Only one instance of qxl interface supported");
-        exit(1);
+    if (display->qxl == NULL) {
+        return 0;
+    }
+    if (spice_server_remove_interface (&display->display_sin.base) != 0) {
+        return -1;
     }
+    if (display->display_sin.id + 1 == b->display_count) {
+        b->display_count--;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
 
-    qxl->display_sin.base.sif = &weston_qxl_interface.base;
-    qxl->display_sin.id = 0;
-    qxl->display_sin.st = (struct QXLState*)qxl;
-    qxl->push_command = push_command;
+static void
+release_command (QXLCommandExt *ext)
+{
+    struct spice_release_info *ri = command_release_info (ext);
+
+    ri->destructor(ri);
 }
 void
-weston_spice_qxl_destroy (spice_backend_t *b)
+weston_spice_qxl_destroy (struct spice_display *display)
 {
-    struct spice_release_info *ri;
-    QXLReleaseInfo *info;
-    while (commands.start < commands.end) {
-        ++commands.start;
-        //Ri is on the top of all QXL commands
-        info = (QXLReleaseInfo *)
-            commands.vector[commands.start - 1]->cmd.data;
-        ri = (struct spice_release_info*)(unsigned long) info->id;
-            ri->destructor(ri);
+    struct weston_spice_qxl *ring = display->qxl;
+    struct cursor_ring *cursor;
+
+    if (ring == NULL) {
+        return;
+    }
+    /* Worker is stopped here, so it is safe to consume from this thread */
+    while (ring->start != ring->end) {
+        release_command (ring->vector[ring->start++ % MAX_COMMAND_NUM]);
+    }
+    cursor = &ring->cursor;
+    while (cursor->start != cursor->end) {
+        release_command (
+                cursor->vector[cursor->start++ % MAX_CURSOR_COMMAND_NUM]);
     }
+    display->backend->core->watch_remove (ring->drain_watch);
+    close (ring->drain_fd);
+    free (ring);
+    display->qxl = NULL;
 }
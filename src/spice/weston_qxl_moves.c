@@ -0,0 +1,408 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <spice/macros.h>
+
+#include "shared/helpers.h"
+#include "weston_qxl_moves.h"
+
+/* Smaller moves are cheaper to send as pixels */
+#define MIN_MOVE_WIDTH  64
+#define MIN_MOVE_ROWS   16
+
+struct row_entry {
+    uint64_t hash;
+    int row;
+};
+
+static uint64_t *
+hash_rows (pixman_image_t *frame, int x, int y, int width, int height)
+{
+    uint8_t *data = (uint8_t *)pixman_image_get_data (frame);
+    int32_t stride = pixman_image_get_stride (frame);
+    uint64_t *rows;
+    int i;
+
+    rows = malloc (height * sizeof *rows);
+    if (rows == NULL) {
+        return NULL;
+    }
+    data += y * stride + x * 4;
+    for (i = 0; i < height; ++i) {
+        rows[i] = spice_hash_row ((const uint32_t *)(data + i * stride),
+                width);
+    }
+    return rows;
+}
+
+static int
+add_move (struct spice_moves *moves, pixman_image_t *frame,
+        const pixman_box32_t *dest, int32_t dx, int32_t dy, int scroll)
+{
+    struct spice_move *move = &moves->moves[moves->count];
+
+    move->rows = hash_rows (frame, dest->x1 - dx, dest->y1 - dy,
+            dest->x2 - dest->x1, dest->y2 - dest->y1);
+    if (move->rows == NULL) {
+        return -1;
+    }
+    move->dest = *dest;
+    move->dx = dx;
+    move->dy = dy;
+    move->scroll = scroll;
+    moves->count++;
+    return 0;
+}
+
+/* Lowest coordinate on the frame whose source is on it as well */
+static inline int32_t
+clamp_min (int32_t value, int32_t delta)
+{
+    if (value < delta) {
+        value = delta;
+    }
+    return value < 0 ? 0 : value;
+}
+
+static int
+box_overlaps (const pixman_box32_t *a, const pixman_box32_t *b)
+{
+    return a->x1 < b->x2 && b->x1 < a->x2 && a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+/* Views which were only translated since the last frame */
+static void
+prepare_view_moves (struct spice_moves *moves,
+        struct weston_output *output, pixman_image_t *frame,
+        pixman_region32_t *damage)
+{
+    struct weston_compositor *ec = output->compositor;
+    int width = pixman_image_get_width (frame);
+    int height = pixman_image_get_height (frame);
+    struct weston_view *ev;
+    pixman_box32_t box;
+    int32_t dx, dy;
+
+    wl_list_for_each(ev, &ec->view_list, link) {
+        if (moves->count == MAX_SPICE_MOVES) {
+            break;
+        }
+        if (ev->plane != &ec->primary_plane ||
+                !(ev->output_mask & (1u << output->id)) ||
+                !ev->transform.motion.valid)
+        {
+            continue;
+        }
+        dx = ev->transform.motion.dx;
+        dy = ev->transform.motion.dy;
+        if (dx == 0 && dy == 0) {
+            continue;
+        }
+
+        /* Both the view and where it came from must be on the frame */
+        box = *pixman_region32_extents (&ev->transform.boundingbox);
+        box.x1 = clamp_min (box.x1 - output->x, dx);
+        box.y1 = clamp_min (box.y1 - output->y, dy);
+        box.x2 = MIN(box.x2 - output->x, MIN(width, width + dx));
+        box.y2 = MIN(box.y2 - output->y, MIN(height, height + dy));
+        if (box.x2 - box.x1 < MIN_MOVE_WIDTH ||
+                box.y2 - box.y1 < MIN_MOVE_ROWS ||
+                pixman_region32_contains_rectangle (damage, &box) ==
+                PIXMAN_REGION_OUT)
+        {
+            continue;
+        }
+        add_move (moves, frame, &box, dx, dy, FALSE);
+    }
+}
+
+void
+spice_moves_track_view (pixman_region32_t *scrolls,
+        struct weston_output *output, struct weston_view *ev)
+{
+    pixman_box32_t *boxes;
+    int n_boxes, i;
+    float x, y;
+
+    if (ev->transform.enabled &&
+            ev->transform.matrix.type > WESTON_MATRIX_TRANSFORM_TRANSLATE)
+    {
+        return;
+    }
+    weston_view_to_global_float (ev, 0, 0, &x, &y);
+
+    boxes = pixman_region32_rectangles (&ev->surface->damage, &n_boxes);
+    for (i = 0; i < n_boxes; ++i) {
+        if (boxes[i].x2 - boxes[i].x1 < MIN_MOVE_WIDTH ||
+                boxes[i].y2 - boxes[i].y1 < 2 * MIN_MOVE_ROWS)
+        {
+            continue;
+        }
+        pixman_region32_union_rect (scrolls, scrolls,
+                (int)x - output->x + boxes[i].x1,
+                (int)y - output->y + boxes[i].y1,
+                boxes[i].x2 - boxes[i].x1, boxes[i].y2 - boxes[i].y1);
+    }
+}
+
+/* Damaged areas big enough to be scrolled content */
+static void
+prepare_scrolls (struct spice_moves *moves, pixman_image_t *frame,
+        pixman_region32_t *damage)
+{
+    pixman_box32_t *boxes;
+    int n_boxes, i, j;
+
+    boxes = pixman_region32_rectangles (damage, &n_boxes);
+    for (i = 0; i < n_boxes && moves->count < MAX_SPICE_MOVES; ++i) {
+        if (boxes[i].x2 - boxes[i].x1 < MIN_MOVE_WIDTH ||
+                boxes[i].y2 - boxes[i].y1 < 2 * MIN_MOVE_ROWS)
+        {
+            continue;
+        }
+        for (j = 0; j < moves->count; ++j) {
+            if (box_overlaps (&moves->moves[j].dest, &boxes[i])) {
+                break;
+            }
+        }
+        if (j == moves->count) {
+            add_move (moves, frame, &boxes[i], 0, 0, TRUE);
+        }
+    }
+}
+
+void
+spice_moves_prepare (struct spice_moves *moves,
+        struct weston_output *output, pixman_image_t *frame,
+        pixman_region32_t *damage, pixman_region32_t *scrolls)
+{
+    pixman_region32_t region;
+
+    moves->count = 0;
+    moves->hashed_count = 0;
+
+    pixman_region32_init (&region);
+    pixman_region32_intersect_rect (&region, damage,
+            output->x, output->y,
+            pixman_image_get_width (frame),
+            pixman_image_get_height (frame));
+    pixman_region32_translate (&region, -output->x, -output->y);
+
+    prepare_view_moves (moves, output, frame, &region);
+    /* Only what clients have redrawn big enough may have scrolled */
+    pixman_region32_intersect (&region, &region, scrolls);
+    prepare_scrolls (moves, frame, &region);
+
+    pixman_region32_fini (&region);
+}
+
+static int
+compare_rows (const void *a, const void *b)
+{
+    const struct row_entry *ra = a, *rb = b;
+
+    return ra->hash < rb->hash ? -1 : ra->hash > rb->hash;
+}
+
+/* Finds vertical offset most of the changed rows moved by. Only rows
+ * unique in the old content vote, so blank lines do not count.
+ */
+static int
+find_scroll (const uint64_t *old_rows, const uint64_t *new_rows,
+        int height, int32_t *dy)
+{
+    struct row_entry *entries, key, *found;
+    int *votes;
+    int i, best = 0;
+
+    entries = malloc (height * sizeof *entries);
+    votes = calloc (2 * height, sizeof *votes);
+    if (entries == NULL || votes == NULL) {
+        free (entries);
+        free (votes);
+        return FALSE;
+    }
+    for (i = 0; i < height; ++i) {
+        entries[i].hash = old_rows[i];
+        entries[i].row = i;
+    }
+    qsort (entries, height, sizeof *entries, compare_rows);
+
+    for (i = 0; i < height; ++i) {
+        if (new_rows[i] == old_rows[i]) {
+            continue;
+        }
+        key.hash = new_rows[i];
+        found = bsearch (&key, entries, height, sizeof *entries,
+                compare_rows);
+        if (found == NULL ||
+                (found > entries && found[-1].hash == key.hash) ||
+                (found < entries + height - 1 &&
+                 found[1].hash == key.hash))
+        {
+            continue;
+        }
+        votes[i - found->row + height]++;
+    }
+    for (i = 0; i < 2 * height; ++i) {
+        if (i != height && votes[i] > best) {
+            best = votes[i];
+            *dy = i - height;
+        }
+    }
+
+    free (entries);
+    free (votes);
+    return best >= MIN_MOVE_ROWS;
+}
+
+/* Longest run of rows where the new content is the old one moved by
+ * dy rows within the candidate.
+ */
+static int
+find_run (const uint64_t *old_rows, const uint64_t *new_rows,
+        int height, int32_t dy, int *start)
+{
+    int i, run = 0, best = 0;
+
+    for (i = 0; i < height; ++i) {
+        if (i - dy >= 0 && i - dy < height &&
+                new_rows[i] == old_rows[i - dy])
+        {
+            if (++run > best) {
+                best = run;
+                *start = i - run + 1;
+            }
+        } else {
+            run = 0;
+        }
+    }
+    return best;
+}
+
+static int
+confirm_move (struct spice_moves *moves, struct spice_move *move,
+        pixman_image_t *frame)
+{
+    int height = move->dest.y2 - move->dest.y1;
+    uint64_t *new_rows;
+    int32_t dy = 0;
+    int start = 0, run = 0;
+
+    new_rows = hash_rows (frame, move->dest.x1, move->dest.y1,
+            move->dest.x2 - move->dest.x1, height);
+    if (new_rows == NULL) {
+        return FALSE;
+    }
+    moves->hashed[moves->hashed_count] = move->dest;
+    moves->hashed_rows[moves->hashed_count++] = new_rows;
+
+    if (!move->scroll) {
+        run = find_run (move->rows, new_rows, height, 0, &start);
+    } else if (find_scroll (move->rows, new_rows, height, &dy)) {
+        run = find_run (move->rows, new_rows, height, dy, &start);
+        move->dy = dy;
+    }
+
+    if (run < MIN_MOVE_ROWS) {
+        return FALSE;
+    }
+    move->dest.y1 += start;
+    move->dest.y2 = move->dest.y1 + run;
+    return TRUE;
+}
+
+int
+spice_moves_finish (struct spice_moves *moves, pixman_image_t *frame)
+{
+    struct spice_move *move;
+    pixman_box32_t source;
+    int i, j, count = 0;
+
+    for (i = 0; i < moves->count; ++i) {
+        move = &moves->moves[i];
+        if (!confirm_move (moves, move, frame)) {
+            goto drop;
+        }
+        /* Copies are done in order, the source must not be
+         * overwritten by earlier ones.
+         */
+        source = move->dest;
+        source.x1 -= move->dx;
+        source.x2 -= move->dx;
+        source.y1 -= move->dy;
+        source.y2 -= move->dy;
+        for (j = 0; j < count; ++j) {
+            if (box_overlaps (&moves->moves[j].dest, &source)) {
+                goto drop;
+            }
+        }
+        free (move->rows);
+        move->rows = NULL;
+        moves->moves[count++] = *move;
+        continue;
+drop:
+        free (move->rows);
+        move->rows = NULL;
+    }
+    moves->count = count;
+    return count;
+}
+
+const uint64_t *
+spice_moves_find_rows (const struct spice_moves *moves,
+        const pixman_box32_t *box)
+{
+    const pixman_box32_t *hashed;
+    int i;
+
+    for (i = 0; i < moves->hashed_count; ++i) {
+        hashed = &moves->hashed[i];
+        if (hashed->x1 == box->x1 && hashed->x2 == box->x2 &&
+                hashed->y1 <= box->y1 && box->y2 <= hashed->y2)
+        {
+            return moves->hashed_rows[i] + box->y1 - hashed->y1;
+        }
+    }
+    return NULL;
+}
+
+void
+spice_moves_release (struct spice_moves *moves)
+{
+    int i;
+
+    for (i = 0; i < moves->count; ++i) {
+        free (moves->moves[i].rows);
+        moves->moves[i].rows = NULL;
+    }
+    moves->count = 0;
+    for (i = 0; i < moves->hashed_count; ++i) {
+        free (moves->hashed_rows[i]);
+    }
+    moves->hashed_count = 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef WESTON_QXL_MOVES_H
+#define WESTON_QXL_MOVES_H
+
+#include <stdint.h>
+#include <pixman.h>
+
+#include "compositor.h"
+
+/* Most QXL_COPY_BITS one frame may emit */
+#define MAX_SPICE_MOVES 4
+
+/* Part of the frame which is the previous frame's content moved by
+ * (dx,dy): a dragged window or a scrolled area. The client already has
+ * those pixels, so it is told to copy them.
+ */
+struct spice_move {
+    pixman_box32_t dest;    /* frame coordinates */
+    int32_t dx, dy;
+
+    /* Candidate found in damage, its offset is searched by content */
+    int scroll;
+    /* Hashes of the source rows taken before repaint */
+    uint64_t *rows;
+};
+
+struct spice_moves {
+    struct spice_move moves[MAX_SPICE_MOVES];
+    int count;
+
+    /* Rows of every candidate hashed on the repainted frame, bitmaps
+     * sent from there take their image ids from them.
+     */
+    pixman_box32_t hashed[MAX_SPICE_MOVES];
+    uint64_t *hashed_rows[MAX_SPICE_MOVES];
+    int hashed_count;
+};
+
+/* FNV-1a over a row of pixels */
+static inline uint64_t
+spice_hash_row (const uint32_t *row, int width)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int x;
+
+    for (x = 0; x < width; ++x) {
+        hash = (hash ^ row[x]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Adds where view's pending surface damage may be scrolled content, in
+ * frame coordinates. Must be called before surface damage is flushed.
+ */
+void
+spice_moves_track_view (pixman_region32_t *scrolls,
+        struct weston_output *output, struct weston_view *ev);
+
+/* Collects candidates from view translations and the tracked scroll
+ * areas which are damaged. Must be called before frame is repainted.
+ */
+void
+spice_moves_prepare (struct spice_moves *moves,
+        struct weston_output *output, pixman_image_t *frame,
+        pixman_region32_t *damage, pixman_region32_t *scrolls);
+
+/* Keeps only candidates confirmed by the repainted frame, shrunk to
+ * the rows which really moved. Returns the number of them.
+ */
+int
+spice_moves_finish (struct spice_moves *moves, pixman_image_t *frame);
+
+/* Row hashes of the box of the repainted frame, if a candidate has
+ * the same columns and covers its rows. NULL otherwise.
+ */
+const uint64_t *
+spice_moves_find_rows (const struct spice_moves *moves,
+        const pixman_box32_t *box);
+
+void
+spice_moves_release (struct spice_moves *moves);
+
+#endif //WESTON_QXL_MOVES_H
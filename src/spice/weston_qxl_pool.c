@@ -0,0 +1,153 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <spice/macros.h>
+
+#include "compositor-spice.h"
+#include "weston_qxl_pool.h"
+
+#define POOL_OBJECT_ALIGN 16
+
+static inline int
+pool_owns (struct spice_pool *pool, struct spice_release_info *ri)
+{
+    uint8_t *p = (uint8_t *)ri;
+
+    return p >= pool->slab &&
+        p < pool->slab + pool->slab_count * pool->object_size;
+}
+
+/* Treiber stack. There is only one thread which pops, so the head
+ * can not be popped and pushed back behind our back (no ABA).
+ */
+static void
+free_list_push (struct spice_pool *pool, struct spice_release_info *ri)
+{
+    struct spice_release_info *head;
+
+    head = __atomic_load_n (&pool->free_list, __ATOMIC_RELAXED);
+    do {
+        ri->next = head;
+    } while (!__atomic_compare_exchange_n (&pool->free_list, &head, ri,
+                TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static struct spice_release_info *
+free_list_pop (struct spice_pool *pool)
+{
+    struct spice_release_info *head;
+
+    head = __atomic_load_n (&pool->free_list, __ATOMIC_ACQUIRE);
+    do {
+        if (head == NULL) {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n (&pool->free_list, &head,
+                head->next, TRUE, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return head;
+}
+
+int
+spice_pool_init (struct spice_pool *pool, const char *name,
+        size_t object_size, size_t count)
+{
+    struct spice_release_info *ri;
+    size_t i;
+
+    assert (object_size >= sizeof *ri);
+
+    memset (pool, 0, sizeof *pool);
+    pool->name = name;
+    pool->object_size = SPICE_ALIGN (object_size, POOL_OBJECT_ALIGN);
+
+    pool->slab = calloc (count, pool->object_size);
+    if (pool->slab == NULL) {
+        weston_log ("Failed to allocate %s pool\n", name);
+        return -1;
+    }
+    pool->slab_count = count;
+
+    for (i = 0; i < count; ++i) {
+        ri = (struct spice_release_info *)
+            (pool->slab + i * pool->object_size);
+        ri->pool = pool;
+        free_list_push (pool, ri);
+    }
+    return 0;
+}
+
+void
+spice_pool_destroy (struct spice_pool *pool)
+{
+    struct spice_release_info *ri;
+
+    if (pool->slab == NULL) {
+        return;
+    }
+
+    weston_log ("Spice %s pool: %u hits, %u misses\n",
+            pool->name, pool->hits, pool->misses);
+
+    while ((ri = free_list_pop (pool)) != NULL) {
+        if (!pool_owns (pool, ri)) {
+            free (ri);
+        }
+    }
+    free (pool->slab);
+    pool->slab = NULL;
+}
+
+void *
+spice_pool_get (struct spice_pool *pool)
+{
+    struct spice_release_info *ri;
+
+    ri = free_list_pop (pool);
+    if (ri != NULL) {
+        ++pool->hits;
+    } else {
+        ++pool->misses;
+        /* Grows the pool, the object is kept on release */
+        ri = malloc (pool->object_size);
+        if (ri == NULL) {
+            return NULL;
+        }
+    }
+
+    memset (ri, 0, pool->object_size);
+    ri->destructor = spice_pool_put;
+    ri->pool = pool;
+
+    return ri;
+}
+
+void
+spice_pool_put (struct spice_release_info *ri)
+{
+    free_list_push (ri->pool, ri);
+}
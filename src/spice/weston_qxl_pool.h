@@ -0,0 +1,65 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef WESTON_QXL_POOL_H
+#define WESTON_QXL_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "weston_spice_interfaces.h"
+
+/* Free-list of preallocated QXL command objects. Every object must start
+ * with struct spice_release_info. Objects are taken by the compositor
+ * thread only, but may be put back from any thread (normally from the
+ * red_worker's release callback).
+ */
+struct spice_pool {
+    const char *name;
+    size_t object_size;
+    uint8_t *slab;
+    size_t slab_count;
+
+    struct spice_release_info *free_list;
+
+    /* Statistics, touched by compositor thread only */
+    uint32_t hits;
+    uint32_t misses;
+};
+
+int
+spice_pool_init (struct spice_pool *pool, const char *name,
+        size_t object_size, size_t count);
+
+void
+spice_pool_destroy (struct spice_pool *pool);
+
+/* Returns zeroed object whose release info destructor returns it back
+ * to the pool. Falls back to heap allocation if the pool is exhausted.
+ */
+void *
+spice_pool_get (struct spice_pool *pool);
+
+void
+spice_pool_put (struct spice_release_info *ri);
+
+#endif //WESTON_QXL_POOL_H
@@ -0,0 +1,246 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <spice/macros.h>
+
+#include "compositor-spice.h"
+#include "weston_qxl_commands.h"
+#include "weston_qxl_surfaces.h"
+
+void
+spice_display_surfaces_init (struct spice_display *display)
+{
+    int id;
+
+    wl_list_init (&display->surfaces);
+    display->free_surface_count = 0;
+    /* Lowest ids are taken first */
+    for (id = display->backend->num_surfaces - 1; id > PRIMARY_SURFACE_ID;
+            --id)
+    {
+        display->free_surfaces[display->free_surface_count++] = id;
+    }
+}
+
+static void
+spice_surface_free (struct spice_surface *ss)
+{
+    wl_list_remove (&ss->link);
+    pixman_region32_fini (&ss->damage);
+    if (ss->snapshot != NULL) {
+        spice_snapshot_unref (ss->snapshot);
+    }
+    free (ss);
+}
+
+/* Surface memory is left to the destroy command. If it did not fit the
+ * ring, the surface stays listed and is retried on the next collect.
+ */
+static void
+spice_surface_release (struct spice_surface *ss)
+{
+    struct spice_display *display = ss->display;
+
+    if (ss->surface != NULL) {
+        wl_list_remove (&ss->destroy_listener.link);
+        ss->surface = NULL;
+    }
+    if (spice_destroy_surface (display, ss->id, ss->data) < 0) {
+        return;
+    }
+    display->free_surfaces[display->free_surface_count++] = ss->id;
+    spice_surface_free (ss);
+}
+
+static void
+spice_surface_handle_destroy (struct wl_listener *listener, void *data)
+{
+    struct spice_surface *ss =
+        wl_container_of(listener, ss, destroy_listener);
+
+    spice_surface_release (ss);
+}
+
+/* Called once red_worker is stopped, so memory is freed right away */
+void
+spice_display_surfaces_destroy (struct spice_display *display)
+{
+    struct spice_surface *ss, *next;
+
+    wl_list_for_each_safe(ss, next, &display->surfaces, link) {
+        if (ss->surface != NULL) {
+            wl_list_remove (&ss->destroy_listener.link);
+        }
+        free (ss->data);
+        spice_surface_free (ss);
+    }
+    display->free_surface_count = 0;
+}
+
+/* A window which has moved to another display leaves its surface on
+ * the old one unused, that one is collected there.
+ */
+static struct spice_surface *
+spice_surface_find (struct spice_display *display, struct weston_surface *es)
+{
+    struct spice_surface *ss;
+
+    wl_list_for_each(ss, &display->surfaces, link) {
+        if (ss->surface == es) {
+            return ss;
+        }
+    }
+    return NULL;
+}
+
+struct spice_surface *
+spice_surface_get (struct spice_display *display, struct weston_surface *es)
+{
+    struct spice_surface *ss;
+
+    ss = spice_surface_find (display, es);
+    if (ss != NULL) {
+        if (ss->width == es->width && ss->height == es->height) {
+            ss->used = TRUE;
+            return ss;
+        }
+        /* Resized */
+        spice_surface_release (ss);
+    }
+
+    if (display->free_surface_count == 0) {
+        return NULL;
+    }
+    ss = zalloc (sizeof *ss);
+    if (ss == NULL) {
+        return NULL;
+    }
+    ss->data = calloc (es->width * es->height, 4);
+    if (ss->data == NULL) {
+        goto err_data;
+    }
+    ss->display = display;
+    ss->width = es->width;
+    ss->height = es->height;
+    ss->id = display->free_surfaces[display->free_surface_count - 1];
+    if (spice_create_surface (display, ss->id, ss->width, ss->height,
+                ss->data) < 0)
+    {
+        goto err_create;
+    }
+    display->free_surface_count--;
+
+    /* New surface is blank, the whole buffer goes */
+    pixman_region32_init_rect (&ss->damage, 0, 0, ss->width, ss->height);
+    ss->surface = es;
+    ss->destroy_listener.notify = spice_surface_handle_destroy;
+    wl_signal_add (&es->destroy_signal, &ss->destroy_listener);
+    wl_list_insert (&display->surfaces, &ss->link);
+    ss->used = TRUE;
+
+    return ss;
+
+err_create:
+    free (ss->data);
+err_data:
+    free (ss);
+    return NULL;
+}
+
+void
+spice_display_surfaces_collect (struct spice_display *display)
+{
+    struct spice_surface *ss, *next;
+
+    wl_list_for_each_safe(ss, next, &display->surfaces, link) {
+        if (!ss->used) {
+            spice_surface_release (ss);
+        } else {
+            ss->used = FALSE;
+        }
+    }
+}
+
+int
+spice_surface_upload (struct spice_surface *ss, pixman_region32_t *sent)
+{
+    struct wl_shm_buffer *shm_buffer =
+        ss->surface->buffer_ref.buffer->shm_buffer;
+    struct spice_snapshot *snapshot;
+    pixman_format_code_t format;
+    pixman_image_t *image;
+
+    pixman_region32_intersect_rect (&ss->damage, &ss->damage,
+            0, 0, ss->width, ss->height);
+    if (!pixman_region32_not_empty (&ss->damage)) {
+        return 0;
+    }
+    spice_damage_reduce (&ss->damage);
+
+    /* Busy one is still read by red_worker, only the damage is
+     * copied so the new one does not need the rest.
+     */
+    if (ss->snapshot == NULL || spice_snapshot_is_busy (ss->snapshot)) {
+        snapshot = spice_snapshot_create (ss->width, ss->height);
+        if (snapshot == NULL) {
+            return -1;
+        }
+        if (ss->snapshot != NULL) {
+            spice_snapshot_unref (ss->snapshot);
+        }
+        ss->snapshot = snapshot;
+    }
+
+    format = wl_shm_buffer_get_format (shm_buffer) ==
+        WL_SHM_FORMAT_XRGB8888 ? PIXMAN_x8r8g8b8 : PIXMAN_a8r8g8b8;
+
+    wl_shm_buffer_begin_access (shm_buffer);
+    image = pixman_image_create_bits (format, ss->width, ss->height,
+            wl_shm_buffer_get_data (shm_buffer),
+            wl_shm_buffer_get_stride (shm_buffer));
+    if (image == NULL) {
+        wl_shm_buffer_end_access (shm_buffer);
+        return -1;
+    }
+    pixman_image_set_clip_region32 (ss->snapshot->image, &ss->damage);
+    pixman_image_composite32 (PIXMAN_OP_SRC,
+            image, NULL, ss->snapshot->image,
+            0, 0, 0, 0, 0, 0, ss->width, ss->height);
+    pixman_image_set_clip_region32 (ss->snapshot->image, NULL);
+    pixman_image_unref (image);
+    wl_shm_buffer_end_access (shm_buffer);
+
+    if (spice_paint_surface (ss->display, ss->id, ss->snapshot,
+                &ss->damage) < 0)
+    {
+        return -1;
+    }
+    pixman_region32_union (sent, sent, &ss->damage);
+    pixman_region32_fini (&ss->damage);
+    pixman_region32_init (&ss->damage);
+    return 0;
+}
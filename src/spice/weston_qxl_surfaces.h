@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef WESTON_QXL_SURFACES_H
+#define WESTON_QXL_SURFACES_H
+
+#include <stdint.h>
+#include <pixman.h>
+
+#include "compositor.h"
+
+struct spice_display;
+struct spice_snapshot;
+
+/* Client window kept in an offscreen QXL surface. red_worker renders
+ * its content once, moving or restacking the window is a draw of the
+ * surface onto the primary one.
+ */
+struct spice_surface {
+    struct weston_surface *surface;     /* NULL once destroyed */
+    struct wl_listener destroy_listener;
+    struct spice_display *display;
+    struct wl_list link;                /* spice_display.surfaces */
+
+    uint32_t id;
+    int width, height;
+    uint8_t *data;                      /* owned by the QXL surface */
+
+    /* Surface coordinates, not sent yet */
+    pixman_region32_t damage;
+    struct spice_snapshot *snapshot;
+
+    /* Was on the plane this frame */
+    int used;
+};
+
+void
+spice_display_surfaces_init (struct spice_display *display);
+
+void
+spice_display_surfaces_destroy (struct spice_display *display);
+
+/* Finds or creates the offscreen surface of es on display. Returns
+ * NULL when there is no free surface id or the worker is behind.
+ */
+struct spice_surface *
+spice_surface_get (struct spice_display *display, struct weston_surface *es);
+
+/* Destroys the surfaces not used this frame and retries the ones
+ * whose destroy command did not fit the ring.
+ */
+void
+spice_display_surfaces_collect (struct spice_display *display);
+
+/* Sends the damaged part of the client buffer. Damage is kept on
+ * failure, added to sent (surface coordinates) on success.
+ */
+int
+spice_surface_upload (struct spice_surface *ss, pixman_region32_t *sent);
+
+#endif //WESTON_QXL_SURFACES_H
@@ -0,0 +1,186 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <spice/macros.h>
+
+#include "shared/helpers.h"
+#include "weston_qxl_video.h"
+
+void
+spice_videos_init (struct spice_videos *videos)
+{
+    wl_list_init (&videos->trackers);
+    videos->count = 0;
+}
+
+static void
+video_tracker_destroy (struct spice_video_tracker *tracker)
+{
+    wl_list_remove (&tracker->destroy_listener.link);
+    wl_list_remove (&tracker->link);
+    free (tracker);
+}
+
+static void
+video_tracker_handle_destroy (struct wl_listener *listener, void *data)
+{
+    struct spice_video_tracker *tracker =
+        wl_container_of(listener, tracker, destroy_listener);
+
+    video_tracker_destroy (tracker);
+}
+
+void
+spice_videos_release (struct spice_videos *videos)
+{
+    struct spice_video_tracker *tracker, *next;
+
+    wl_list_for_each_safe(tracker, next, &videos->trackers, link) {
+        video_tracker_destroy (tracker);
+    }
+    videos->count = 0;
+}
+
+void
+spice_videos_begin (struct spice_videos *videos)
+{
+    videos->count = 0;
+}
+
+/* Every output keeps its own history of the surface */
+static struct spice_video_tracker *
+video_tracker_get (struct spice_videos *videos, struct weston_surface *es)
+{
+    struct spice_video_tracker *tracker;
+
+    wl_list_for_each(tracker, &videos->trackers, link) {
+        if (tracker->surface == es) {
+            return tracker;
+        }
+    }
+    return NULL;
+}
+
+static struct spice_video_tracker *
+video_tracker_create (struct spice_videos *videos, struct weston_surface *es)
+{
+    struct spice_video_tracker *tracker;
+
+    tracker = zalloc (sizeof *tracker);
+    if (tracker == NULL) {
+        return NULL;
+    }
+    tracker->surface = es;
+    tracker->destroy_listener.notify = video_tracker_handle_destroy;
+    wl_signal_add (&es->destroy_signal, &tracker->destroy_listener);
+    wl_list_insert (&videos->trackers, &tracker->link);
+    return tracker;
+}
+
+/* Damage of a video frame covers most of the surface */
+static int
+damage_is_large (struct weston_surface *es)
+{
+    pixman_box32_t *extents = pixman_region32_extents (&es->damage);
+    int64_t area = (int64_t)(extents->x2 - extents->x1) *
+        (extents->y2 - extents->y1);
+
+    return area * 2 >= (int64_t)es->width * es->height;
+}
+
+int
+spice_videos_track (struct spice_videos *videos,
+        struct weston_output *output, struct weston_view *ev)
+{
+    struct weston_surface *es = ev->surface;
+    struct spice_video_tracker *tracker;
+    pixman_box32_t *bbox, *box;
+    uint32_t msec = output->frame_time;
+    int was_video, steady, large;
+
+    /* Stream goes to a single display */
+    if (ev->output_mask != (1u << output->id)) {
+        return FALSE;
+    }
+    if (es->width < VIDEO_MIN_WIDTH || es->height < VIDEO_MIN_HEIGHT) {
+        return FALSE;
+    }
+
+    tracker = video_tracker_get (videos, es);
+    was_video = tracker != NULL && tracker->frames >= VIDEO_MIN_FRAMES;
+
+    if (pixman_region32_not_empty (&es->damage)) {
+        large = damage_is_large (es);
+        if (tracker == NULL) {
+            if (!large) {
+                return FALSE;
+            }
+            tracker = video_tracker_create (videos, es);
+            if (tracker == NULL) {
+                return FALSE;
+            }
+        }
+
+        steady = large && tracker->frames > 0 &&
+            tracker->width == es->width && tracker->height == es->height &&
+            msec - tracker->last_msec <= VIDEO_MAX_INTERVAL;
+        tracker->frames = steady ? tracker->frames + 1 : large;
+        tracker->width = es->width;
+        tracker->height = es->height;
+        tracker->last_msec = msec;
+    } else if (tracker != NULL &&
+            msec - tracker->last_msec > VIDEO_MAX_INTERVAL)
+    {
+        tracker->frames = 0;
+    }
+
+    if (tracker == NULL || tracker->frames < VIDEO_MIN_FRAMES) {
+        if (was_video) {
+            weston_log ("Spice video %dx%d on %s stopped\n",
+                    tracker->width, tracker->height, output->name);
+        }
+        return FALSE;
+    }
+    if (!was_video) {
+        weston_log ("Spice video %dx%d on %s, sending as stream\n",
+                tracker->width, tracker->height, output->name);
+    }
+    if (videos->count >= MAX_SPICE_VIDEOS) {
+        return FALSE;
+    }
+
+    bbox = pixman_region32_extents (&ev->transform.boundingbox);
+    box = &videos->boxes[videos->count];
+    box->x1 = (bbox->x1 > output->x ? bbox->x1 : output->x) - output->x;
+    box->y1 = (bbox->y1 > output->y ? bbox->y1 : output->y) - output->y;
+    box->x2 = MIN (bbox->x2, output->x + output->width) - output->x;
+    box->y2 = MIN (bbox->y2, output->y + output->height) - output->y;
+    if (box->x1 >= box->x2 || box->y1 >= box->y2) {
+        return FALSE;
+    }
+    videos->count++;
+    return TRUE;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright © 2013-2016 Yury Shvedov <shved@lvk.cs.msu.su>
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef WESTON_QXL_VIDEO_H
+#define WESTON_QXL_VIDEO_H
+
+#include <stdint.h>
+#include <pixman.h>
+
+#include "compositor.h"
+
+/* Most videos streamed from one output */
+#define MAX_SPICE_VIDEOS 4
+
+/* Slowest frame rate still taken for video, ms between frames */
+#define VIDEO_MAX_INTERVAL 100
+/* Steady frames before a surface is taken for video */
+#define VIDEO_MIN_FRAMES 10
+/* Smaller surfaces are not worth a stream */
+#define VIDEO_MIN_WIDTH 128
+#define VIDEO_MIN_HEIGHT 96
+
+/* Commit history of a surface which damages most of itself */
+struct spice_video_tracker {
+    struct weston_surface *surface;
+    struct wl_listener destroy_listener;
+    struct wl_list link;
+
+    int32_t width, height;
+    uint32_t last_msec;
+    int frames;
+};
+
+/* Surfaces committing at a steady rate at a stable size: players and
+ * animations. Their damage is sent as the whole view every frame, so
+ * red_worker sees same-sized drawables at the same place and streams
+ * them, while the rest of the output stays lossless.
+ */
+struct spice_videos {
+    struct wl_list trackers;
+    pixman_box32_t boxes[MAX_SPICE_VIDEOS];     /* output coordinates */
+    int count;
+};
+
+void
+spice_videos_init (struct spice_videos *videos);
+
+void
+spice_videos_release (struct spice_videos *videos);
+
+/* Forgets boxes of the previous frame */
+void
+spice_videos_begin (struct spice_videos *videos);
+
+/* Must see every view of the output before its damage is flushed.
+ * Returns TRUE if the view is a video, its box is recorded then.
+ */
+int
+spice_videos_track (struct spice_videos *videos,
+        struct weston_output *output, struct weston_view *ev);
+
+#endif //WESTON_QXL_VIDEO_H
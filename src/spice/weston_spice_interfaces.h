@@ -23,8 +23,22 @@
 #ifndef _WESTON_SPICE_INTERFACES_
 #define _WESTON_SPICE_INTERFACES_
 
+#include <stdint.h>
+
+struct spice_pool;
+struct spice_display;
+
 struct spice_release_info {
     void (*destructor) (struct spice_release_info *);
+
+    /* Owning pool and free-list link for pooled commands */
+    struct spice_pool *pool;
+    struct spice_release_info *next;
+
+    /* Monotonic ms of the push, for release latency */
+    uint32_t push_msec;
+    /* Bitmap memory red_worker holds until release */
+    uint32_t bytes;
 };
 
 typedef struct spice_backend spice_backend_t;
@@ -32,14 +46,17 @@ typedef struct weston_spice_mouse weston_spice_mouse_t;
 typedef struct weston_spice_kbd weston_spice_kbd_t;
 typedef struct weston_spice_qxl weston_spice_qxl_t;
 
-void weston_spice_qxl_init (spice_backend_t *qxl);
-void weston_spice_mouse_init (spice_backend_t *c);
+int weston_spice_qxl_init (struct spice_display *display);
+int weston_spice_mouse_init (spice_backend_t *c);
 int weston_spice_kbd_init (spice_backend_t *c);
 
-void weston_spice_qxl_destroy (spice_backend_t *c);
+int weston_spice_qxl_remove (struct spice_display *display);
+void weston_spice_qxl_destroy (struct spice_display *display);
 void weston_spice_mouse_destroy (spice_backend_t *c);
 void weston_spice_kbd_destroy (spice_backend_t *c);
 
+void weston_spice_mouse_flush (spice_backend_t *c);
+
 void release_simple (struct spice_release_info *);
 
 #endif //_WESTON_QXL_INTERFACE_
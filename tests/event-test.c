@@ -284,6 +284,62 @@ TEST(test_pointer_surface_move)
 	check_pointer(client, 50, 50);
 }
 
+TEST(test_pointer_surface_move_across_cells)
+{
+	struct client *client;
+
+	/* views are picked from 128 pixel cells, the pointer sits on the
+	 * first pixel of one, the surface edge crosses it */
+	client = create_client_and_test_surface(156, 156, 100, 100);
+	assert(client);
+
+	assert(!surface_contains(client->surface, 256, 256));
+	check_pointer_move(client, 256, 256);
+
+	move_client(client, 157, 157);
+	assert(surface_contains(client->surface, 256, 256));
+	check_pointer(client, 256, 256);
+
+	move_client(client, 256, 256);
+	assert(surface_contains(client->surface, 256, 256));
+	check_pointer(client, 256, 256);
+
+	move_client(client, 257, 257);
+	assert(!surface_contains(client->surface, 256, 256));
+	check_pointer(client, 256, 256);
+}
+
+TEST(test_pointer_input_region_repick)
+{
+	struct client *client;
+	struct pointer *pointer;
+	struct wl_region *region;
+
+	client = create_client_and_test_surface(100, 100, 100, 100);
+	assert(client);
+	pointer = client->input->pointer;
+
+	check_pointer_move(client, 150, 150);
+	assert(pointer->focus == client->surface);
+
+	/* the pointer stays still, the input region leaves it */
+	region = wl_compositor_create_region(client->wl_compositor);
+	wl_region_add(region, 0, 0, 100, 40);
+	wl_surface_set_input_region(client->surface->wl_surface, region);
+	wl_region_destroy(region);
+	commit_and_wait(client, client->surface);
+	client_roundtrip(client);
+	assert(pointer->focus == NULL);
+
+	/* and comes back */
+	wl_surface_set_input_region(client->surface->wl_surface, NULL);
+	commit_and_wait(client, client->surface);
+	client_roundtrip(client);
+	assert(pointer->focus == client->surface);
+	assert(pointer->x == 50);
+	assert(pointer->y == 50);
+}
+
 static int
 output_contains_client(struct client *client)
 {
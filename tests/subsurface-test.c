@@ -559,3 +559,49 @@ TEST(test_subsurface_destroy_permutations)
 	client_roundtrip(client);
 	fprintf(stderr, "tried %d destroy permutations\n", counter);
 }
+
+TEST(test_subsurface_restack_repick)
+{
+	struct client *client;
+	struct wl_subcompositor *subco;
+	struct wl_subsurface *sub;
+	struct surface *parent;
+	struct surface *child;
+	struct pointer *pointer;
+
+	client = create_client_and_test_surface(100, 100, 100, 100);
+	assert(client);
+	parent = client->surface;
+	pointer = client->input->pointer;
+
+	/* child covers the whole parent, synchronized */
+	subco = get_subcompositor(client);
+	child = xzalloc(sizeof *child);
+	child->wl_surface =
+		wl_compositor_create_surface(client->wl_compositor);
+	wl_surface_set_user_data(child->wl_surface, child);
+	child->wl_buffer = create_shm_buffer(client, 100, 100, NULL);
+	sub = wl_subcompositor_get_subsurface(subco, child->wl_surface,
+					      parent->wl_surface);
+	wl_surface_attach(child->wl_surface, child->wl_buffer, 0, 0);
+	wl_surface_damage(child->wl_surface, 0, 0, 100, 100);
+	wl_surface_commit(child->wl_surface);
+	commit_and_wait(client, parent);
+
+	weston_test_move_pointer(client->test->weston_test, 150, 150);
+	client_roundtrip(client);
+	assert(pointer->focus == child);
+
+	/* the new order takes effect on the parent's commit only */
+	wl_subsurface_place_below(sub, parent->wl_surface);
+	client_roundtrip(client);
+	assert(pointer->focus == child);
+	commit_and_wait(client, parent);
+	client_roundtrip(client);
+	assert(pointer->focus == parent);
+
+	wl_subsurface_place_above(sub, parent->wl_surface);
+	commit_and_wait(client, parent);
+	client_roundtrip(client);
+	assert(pointer->focus == child);
+}
@@ -124,6 +124,18 @@ move_client(struct client *client, int x, int y)
 	frame_callback_wait(client, &done);
 }
 
+void
+commit_and_wait(struct client *client, struct surface *surface)
+{
+	int done;
+
+	wl_surface_damage(surface->wl_surface, 0, 0, surface->width,
+			  surface->height);
+	frame_callback_set(surface->wl_surface, &done);
+	wl_surface_commit(surface->wl_surface);
+	frame_callback_wait(client, &done);
+}
+
 int
 get_n_egl_buffers(struct client *client)
 {